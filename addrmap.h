@@ -0,0 +1,260 @@
+#ifndef ADDRMAP_H
+#define ADDRMAP_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/*
+ *    Canonical address keys
+ *
+ *    A v4 client reaches an AF_INET6 socket as ::ffff:a.b.c.d, the same
+ *    client on an AF_INET socket as a.b.c.d. An addr_key holds either as
+ *    the 16 byte v6 form, v4 as v4-mapped, plus the port, so both compare
+ *    and hash equal. It is 20 bytes with no padding to clear and hashes
+ *    with three multiplies.
+ */
+
+struct addr_key {
+    unsigned char addr[16];         /* v6, or v4 as ::ffff:a.b.c.d */
+    uint16_t port;                  /* network order, 0 to key on the address alone */
+    uint16_t zero;                  /* keeps the key free of padding */
+};
+
+static const unsigned char addr_key_v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* Key of sa, with its port if with_port. Unknown families give the zero key. */
+static inline void addr_key_set(struct addr_key *k, const struct sockaddr *sa, int with_port) {
+    memset(k, 0, sizeof(*k));
+    switch (sa->sa_family) {
+    case AF_INET:
+        memcpy(k->addr, addr_key_v4mapped, 12);
+        memcpy(k->addr + 12, &((struct sockaddr_in *)sa)->sin_addr, 4);
+        if (with_port)
+            k->port = ((struct sockaddr_in *)sa)->sin_port;
+        break;
+    case AF_INET6:
+        memcpy(k->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        if (with_port)
+            k->port = ((struct sockaddr_in6 *)sa)->sin6_port;
+        break;
+    }
+}
+
+static inline int addr_key_is_v4(const struct addr_key *k) {
+    return memcmp(k->addr, addr_key_v4mapped, 12) == 0;
+}
+
+static inline int addr_key_equal(const struct addr_key *a, const struct addr_key *b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static inline uint32_t addr_key_hash(const struct addr_key *k) {
+    uint64_t lo, hi;
+    uint32_t port;
+
+    memcpy(&lo, k->addr, 8);
+    memcpy(&hi, k->addr + 8, 8);
+    memcpy(&port, &k->port, 4);
+    /* v4 varies only in the top bytes of hi, fold them down before masking */
+    hi = (hi ^ ((lo ^ port) * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    hi ^= hi >> 32;
+    hi *= 0xc4ceb9fe1a85ec53ULL;
+    return (uint32_t)(hi ^ (hi >> 29));
+}
+
+/*
+ *    addr_key_name - printable address of k, v4 as a.b.c.d
+ *
+ *    Like sockaddr2name(), the result lives in a per-thread static buffer.
+ */
+static __thread char addr_key_buffer[INET6_ADDRSTRLEN];
+static inline char *addr_key_name(const struct addr_key *k) {
+    const unsigned char *a = k->addr + 12;
+    char *p = addr_key_buffer;
+    int i;
+
+    if (!addr_key_is_v4(k)) {
+        inet_ntop(AF_INET6, k->addr, addr_key_buffer, INET6_ADDRSTRLEN);
+        return addr_key_buffer;
+    }
+
+    /* Dotted quad by hand, this is the common case */
+    for (i = 0; i < 4; i++) {
+        if (a[i] >= 100)
+            *p++ = '0' + a[i] / 100;
+        if (a[i] >= 10)
+            *p++ = '0' + a[i] / 10 % 10;
+        *p++ = '0' + a[i] % 10;
+        *p++ = (i < 3) ? '.' : '\0';
+    }
+    return addr_key_buffer;
+}
+
+/* addr_key_name() with the port, [v6]:port or v4:port */
+static inline char *addr_key_nameport(const struct addr_key *k) {
+    static __thread char buffer[INET6_ADDRSTRLEN + 16];
+
+    if (addr_key_is_v4(k))
+        snprintf(buffer, sizeof(buffer), "%s:%u", addr_key_name(k), ntohs(k->port));
+    else
+        snprintf(buffer, sizeof(buffer), "[%s]:%u", addr_key_name(k), ntohs(k->port));
+    return buffer;
+}
+
+/*
+ *    Address map
+ *
+ *    Open addressing hash table from addr_key to a fixed size value, with
+ *    linear probing and backward shift deletion so there are no tombstones.
+ *    The slots live in memory the caller provides, ADDR_MAP_SIZE() bytes
+ *    for a power of two number of slots, so it can be placed on the right
+ *    NUMA node. The map does not grow; it refuses inserts beyond 3/4 full
+ *    and the caller decides what to drop with addr_map_sweep().
+ */
+
+struct addr_map_slot {
+    struct addr_key key;
+    uint32_t hash;                  /* 0 marks an empty slot */
+    /* value follows, 8 byte aligned */
+};
+
+struct addr_map {
+    char *slots;
+    size_t stride;                  /* bytes per slot, value included */
+    size_t mask;                    /* slots - 1 */
+    size_t count;
+    size_t max;                     /* 3/4 of the slots */
+};
+
+#define ADDR_MAP_STRIDE(value_size) \
+    ((sizeof(struct addr_map_slot) + 7) / 8 * 8 + ((value_size) + 7) / 8 * 8)
+#define ADDR_MAP_SIZE(slots, value_size) ((slots) * ADDR_MAP_STRIDE(value_size))
+
+static inline void addr_map_init(struct addr_map *m, void *mem, size_t slots, size_t value_size) {
+    m->slots = (char *)mem;
+    m->stride = ADDR_MAP_STRIDE(value_size);
+    m->mask = slots - 1;
+    m->count = 0;
+    m->max = slots / 4 * 3;
+    memset(mem, 0, ADDR_MAP_SIZE(slots, value_size));
+}
+
+static inline struct addr_map_slot *addr_map_slot(struct addr_map *m, size_t i) {
+    return (struct addr_map_slot *)(m->slots + (i & m->mask) * m->stride);
+}
+
+static inline void *addr_map_value(struct addr_map *m, struct addr_map_slot *s) {
+    return (char *)s + (sizeof(struct addr_map_slot) + 7) / 8 * 8;
+}
+
+static inline uint32_t addr_map_hash(const struct addr_key *k) {
+    uint32_t hash = addr_key_hash(k);
+
+    return hash ? hash : 1;
+}
+
+/* Value of k, NULL if it is not in m */
+static inline void *addr_map_find(struct addr_map *m, const struct addr_key *k) {
+    uint32_t hash = addr_map_hash(k);
+    struct addr_map_slot *s;
+    size_t i;
+
+    for (i = hash;; i++) {
+        s = addr_map_slot(m, i);
+        if (s->hash == 0)
+            return NULL;
+        if (s->hash == hash && addr_key_equal(&s->key, k))
+            return addr_map_value(m, s);
+    }
+}
+
+/*
+ *    Value of k, added zeroed if it was not there. *created tells which.
+ *    Returns NULL when the map is full.
+ */
+static inline void *addr_map_insert(struct addr_map *m, const struct addr_key *k, int *created) {
+    uint32_t hash = addr_map_hash(k);
+    struct addr_map_slot *s;
+    size_t i;
+
+    *created = 0;
+    for (i = hash;; i++) {
+        s = addr_map_slot(m, i);
+        if (s->hash == 0)
+            break;
+        if (s->hash == hash && addr_key_equal(&s->key, k))
+            return addr_map_value(m, s);
+    }
+    if (m->count >= m->max)
+        return NULL;
+
+    memset(s, 0, m->stride);
+    s->key = *k;
+    s->hash = hash;
+    m->count++;
+    *created = 1;
+    return addr_map_value(m, s);
+}
+
+/* Empty slot i, moving back the entries probing past it. */
+static inline void addr_map_remove_slot(struct addr_map *m, size_t i) {
+    struct addr_map_slot *hole = addr_map_slot(m, i), *s;
+    size_t j, home;
+
+    for (j = i + 1;; j++) {
+        s = addr_map_slot(m, j);
+        if (s->hash == 0)
+            break;
+        /* Move s into the hole unless its home slot lies after the hole */
+        home = s->hash & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            memcpy(hole, s, m->stride);
+            hole = s;
+            i = j;
+        }
+    }
+    hole->hash = 0;
+    m->count--;
+}
+
+static inline int addr_map_remove(struct addr_map *m, const struct addr_key *k) {
+    uint32_t hash = addr_map_hash(k);
+    struct addr_map_slot *s;
+    size_t i;
+
+    for (i = hash;; i++) {
+        s = addr_map_slot(m, i);
+        if (s->hash == 0)
+            return 0;
+        if (s->hash == hash && addr_key_equal(&s->key, k)) {
+            addr_map_remove_slot(m, i);
+            return 1;
+        }
+    }
+}
+
+/* Remove every entry keep() returns 0 for, returns how many went */
+static inline size_t addr_map_sweep(struct addr_map *m, int (*keep)(const struct addr_key *, void *, void *),
+                                    void *arg) {
+    struct addr_map_slot *s;
+    size_t i, removed = 0;
+
+    /* A removal may shift the next entry into slot i, look at it again */
+    for (i = 0; i <= m->mask;) {
+        s = addr_map_slot(m, i);
+        if (s->hash != 0 && !keep(&s->key, addr_map_value(m, s), arg)) {
+            addr_map_remove_slot(m, i);
+            removed++;
+            continue;
+        }
+        i++;
+    }
+    return removed;
+}
+
+#endif /* ADDRMAP_H */
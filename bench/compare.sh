@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+#    compare.sh - compare two bench/run.sh result files
+#
+#    Matches lines on bench, variant/proto/mode, size, conns and busy poll
+#    budget and prints the old value, the new value and the change for the
+#    main metric of each: ns_per_op for microbenchmarks, rps and p99_us for
+#    loadgen.
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 old.jsonl new.jsonl" >&2
+    exit 1
+fi
+
+jq -rn --slurpfile a "$1" --slurpfile b "$2" '
+    def key: [.bench, .variant, .proto, .mode, .size, .conns, .busy_poll_us, .depth, .speed] | map(select(. != null) | tostring) | join(" ");
+    def change($x; $y): if $x == 0 then "-" else (($y - $x) * 100 / $x * 10 | round / 10 | tostring) + "%" end;
+    ($a | map({key: key, value: .}) | from_entries) as $old
+    | $b[]
+    | key as $k
+    | select($old[$k])
+    | $old[$k] as $o
+    | if .ns_per_op then
+          "\($k)\tns_per_op\t\($o.ns_per_op)\t\(.ns_per_op)\t\(change($o.ns_per_op; .ns_per_op))"
+      else
+          "\($k)\trps\t\($o.rps)\t\(.rps)\t\(change($o.rps; .rps))",
+          "\($k)\tp99_us\t\($o.p99_us)\t\(.p99_us)\t\(change($o.p99_us; .p99_us))"
+      end
+'
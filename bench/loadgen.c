@@ -0,0 +1,533 @@
+/*
+ *    loadgen - closed loop load client for the servers in this repo
+ *
+ *    Opens conns tcp connections (or connected udp sockets) to host port,
+ *    keeps one request outstanding on each and times every round trip.
+ *    A unix:/path, unix:@name, unixpacket:/path or unixpacket:@name host
+ *    (see sockaddr.h) connects over a unix domain socket instead and takes
+ *    no port. shm: followed by such an endpoint sets up a shared memory
+ *    channel with server -m and sends the requests through its rings.
+ *    Prints one JSON line with throughput and latency percentiles.
+ *    With -B usec it spins on poll() that long before blocking, to match a
+ *    server running with -P.
+ *
+ *    With -f it speaks the framed protocol of server -F (see frame.h) and
+ *    keeps -p depth requests in flight on each connection, timing each by
+ *    its id.
+ *
+ *    The reply shape depends on the server:
+ *      hexdump   server          reply is the 16/8 hexdump of the request
+ *      rot13     rot13-event     request is a line, reply the same length
+ *      echo      getaddrinfo-server, test
+ *                                reply is the request
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "frame.h"
+#include "hexdump.h"
+#include "shmring.h"
+#include "sockaddr.h"
+
+#define MAX_CONNS       256
+#define MAX_PAYLOAD     65507
+#define UDP_TIMEOUT_MS  1000
+#define MAX_DEPTH       1024
+#define SHM_REQ_RING    (1 << 20)
+#define SHM_REP_RING    (1 << 21)
+
+enum mode {
+    MODE_HEXDUMP,
+    MODE_ROT13,
+    MODE_ECHO,
+};
+
+struct conn {
+    int fd;
+    size_t got;                     /* reply bytes received so far */
+    uint64_t sent_at;
+
+    /* Framed mode */
+    uint64_t next_id;               /* id of the next request */
+    int inflight;
+    uint64_t *sent_at_id;           /* send time of id, at id % depth */
+    unsigned char hdr[FRAME_HEADER_MAX];
+    int hdrlen;                     /* reply header bytes so far */
+    uint64_t skip;                  /* reply payload bytes still to come */
+
+    /* Shared memory mode, fd is the reply eventfd */
+    struct shm_ring req, rep;
+    int ctl;
+};
+
+struct latencies {
+    uint64_t *ns;
+    size_t count, size;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct latencies *l, uint64_t ns) {
+    if (l->count == l->size) {
+        l->size = l->size ? l->size * 2 : 65536;
+        l->ns = (uint64_t *)realloc(l->ns, l->size * sizeof(*l->ns));
+        if (l->ns == NULL) {
+            perror("realloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->ns[l->count++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Latency at percentile p of the sorted samples, in microseconds */
+static double percentile(struct latencies *l, double p) {
+    size_t i;
+
+    if (l->count == 0)
+        return 0;
+    i = (size_t)(p / 100.0 * (l->count - 1) + 0.5);
+    return l->ns[i] / 1000.0;
+}
+
+static int connect_to(const char *host, const char *port, int socktype) {
+    struct addrinfo hints, *result, *rp;
+    struct sockaddr_un sun;
+    socklen_t sunlen;
+    int fd = -1, s, one = 1;
+
+    if (unix_endpoint(host, &sun, &sunlen, &socktype) == 1) {
+        fd = socket(AF_UNIX, socktype, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&sun, sunlen) == -1) {
+            perror(host);
+            exit(EXIT_FAILURE);
+        }
+        return fd;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+
+    s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        exit(EXIT_FAILURE);
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) != -1)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd == -1) {
+        fprintf(stderr, "Could not connect to %s %s\n", host, port);
+        exit(EXIT_FAILURE);
+    }
+    if (socktype == SOCK_STREAM)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* A shared memory channel with server -m on the unix endpoint spec, for mode */
+static void shm_connect(struct conn *c, const char *spec, enum mode mode) {
+    static const int modes[] = { SHM_HEXDUMP, SHM_ROT13, SHM_ECHO };
+    char control[CMSG_SPACE(3 * sizeof(int))], byte = 'C';
+    struct iovec iov = { &byte, 1 };
+    struct shm_channel *ch;
+    struct shm_layout layout;
+    struct sockaddr_un sun;
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    socklen_t sunlen;
+    int fds[3], socktype;
+
+    ch = shm_channel_create(SHM_REQ_RING, SHM_REP_RING, modes[mode], &fds[0]);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch == NULL || fds[1] == -1 || fds[2] == -1) {
+        perror("shm channel");
+        exit(EXIT_FAILURE);
+    }
+    shm_channel_layout(ch, &layout);
+    shm_channel_rings(ch, &layout, &c->req, fds[1], &c->rep, fds[2]);
+
+    if (unix_endpoint(spec, &sun, &sunlen, &socktype) != 1 ||
+            (c->ctl = socket(AF_UNIX, socktype, 0)) == -1 ||
+            connect(c->ctl, (struct sockaddr *)&sun, sunlen) == -1) {
+        perror(spec);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(c->ctl, &mh, MSG_NOSIGNAL) != 1 || recv(c->ctl, &byte, 1, 0) != 1) {
+        fprintf(stderr, "%s: no shared memory channel\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    close(fds[0]);
+    c->fd = fds[2];
+}
+
+static void send_request(struct conn *c, const char *payload, size_t size) {
+    c->got = 0;
+    c->sent_at = now_ns();
+    if (c->req.ctl != NULL) {
+        if (shm_ring_send(&c->req, payload, size) == -1) {
+            fprintf(stderr, "request ring full or broken\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (send(c->fd, payload, size, MSG_NOSIGNAL) != (ssize_t)size) {
+        perror("send()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Send count framed requests of size bytes on c, in one write */
+static void send_frames(struct conn *c, int count, int depth, const char *payload, size_t size, unsigned char *buf) {
+    size_t len = 0;
+    uint64_t now = now_ns();
+    int i;
+
+    for (i = 0; i < count; i++) {
+        len += frame_header_encode(size, c->next_id, buf + len);
+        memcpy(buf + len, payload, size);
+        len += size;
+        c->sent_at_id[c->next_id % depth] = now;
+        c->next_id++;
+    }
+    c->inflight += count;
+    if (send(c->fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        perror("send()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ *    Consume n reply bytes of a framed connection, recording the latency
+ *    of every reply completed. Returns the number of replies completed.
+ */
+static int frames_received(struct conn *c, const unsigned char *p, size_t n, int depth,
+                           size_t expected, struct latencies *lat) {
+    uint64_t length, id, now = now_ns();
+    size_t take;
+    int ret, done = 0;
+
+    while (n > 0) {
+        if (c->skip > 0) {
+            take = (n < c->skip) ? n : c->skip;
+            c->skip -= take;
+            p += take;
+            n -= take;
+            continue;
+        }
+
+        /* Gather the header a byte at a time, it may span reads */
+        c->hdr[c->hdrlen++] = *p++;
+        n--;
+        ret = frame_header_decode(c->hdr, c->hdrlen, &length, &id);
+        if (ret == 0 && c->hdrlen < FRAME_HEADER_MAX)
+            continue;
+        if (ret <= 0 || length != expected || id >= c->next_id || c->next_id - id > (uint64_t)c->inflight) {
+            fprintf(stderr, "bad reply frame\n");
+            exit(EXIT_FAILURE);
+        }
+        c->hdrlen = 0;
+        c->skip = length;
+        record(lat, now - c->sent_at_id[id % depth]);
+        c->inflight--;
+        done++;
+    }
+    return done;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t tcp|udp] [-m hexdump|rot13|echo] [-c conns] [-s size]\n"
+            "\t[-d seconds | -n requests] [-B busy_poll_us] [-f] [-p depth] [-l label] host port\n"
+            "\thost may be unix:/path, unix:@name, unixpacket:/path or unixpacket:@name, without port,\n"
+            "\tor shm: and one of those for a shared memory channel\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static char payload[MAX_PAYLOAD], reply[HEXDUMP_LENGTH(MAX_PAYLOAD, 16, 8)];
+    static struct conn conns[MAX_CONNS];
+    static struct pollfd pfds[MAX_CONNS];
+    struct latencies lat = { NULL, 0, 0 };
+    struct sockaddr_un sun;
+    socklen_t sunlen;
+    const char *port = NULL, *shm = NULL;
+    const char *label = "loadgen", *proto = "tcp", *mode_name = "hexdump";
+    enum mode mode = MODE_HEXDUMP;
+    int socktype = SOCK_STREAM, nconns = 1, busy_poll = 0, framed = 0, depth = 1, opt, i, ret, done;
+    unsigned char *framebuf = NULL;
+    size_t size = 64, expected, total = 0, limit = 0, lost = 0;
+    double seconds = 2;
+    uint64_t start, deadline, elapsed, spin_until;
+    ssize_t n;
+
+    while ((opt = getopt(argc, argv, "t:m:c:s:d:n:B:fp:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            proto = optarg;
+            if (strcmp(optarg, "tcp") == 0)
+                socktype = SOCK_STREAM;
+            else if (strcmp(optarg, "udp") == 0)
+                socktype = SOCK_DGRAM;
+            else
+                usage(argv[0]);
+            break;
+        case 'm':
+            mode_name = optarg;
+            if (strcmp(optarg, "hexdump") == 0)
+                mode = MODE_HEXDUMP;
+            else if (strcmp(optarg, "rot13") == 0)
+                mode = MODE_ROT13;
+            else if (strcmp(optarg, "echo") == 0)
+                mode = MODE_ECHO;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            if (nconns < 1 || nconns > MAX_CONNS)
+                usage(argv[0]);
+            break;
+        case 's':
+            size = atoi(optarg);
+            if (size < 1 || size > MAX_PAYLOAD)
+                usage(argv[0]);
+            break;
+        case 'd':
+            seconds = atof(optarg);
+            break;
+        case 'n':
+            limit = atoi(optarg);
+            break;
+        case 'B':
+            busy_poll = atoi(optarg);
+            break;
+        case 'f':
+            framed = 1;
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            if (depth < 1 || depth > MAX_DEPTH)
+                usage(argv[0]);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    /* A unix endpoint decides the socket type */
+    if (optind < argc && strncmp(argv[optind], "shm:", 4) == 0)
+        shm = argv[optind] + 4;
+    if (optind == argc || (ret = unix_endpoint(shm ? shm : argv[optind], &sun, &sunlen, &socktype)) == -1 ||
+            argc - optind != (ret == 1 ? 1 : 2) || (shm && (ret != 1 || framed)))
+        usage(argv[0]);
+    if (shm)
+        proto = "shm";
+    else if (ret == 1)
+        proto = (socktype == SOCK_SEQPACKET) ? "unixpacket" : "unix";
+    else
+        port = argv[optind + 1];
+    /* Only a stream can pipeline, and only the framed protocol tells replies apart */
+    if ((framed && (socktype != SOCK_STREAM || mode != MODE_HEXDUMP)) || (depth > 1 && !framed))
+        usage(argv[0]);
+
+    /* Printable payload, rot13 wants a line */
+    for (i = 0; i < (int)size; i++)
+        payload[i] = 'a' + i % 26;
+    if (mode == MODE_ROT13)
+        payload[size - 1] = '\n';
+
+    expected = size;
+    if (mode == MODE_HEXDUMP)
+        expected = hexdump(reply, payload, size, 16, 8);
+
+    for (i = 0; i < nconns; i++) {
+        if (shm)
+            shm_connect(&conns[i], shm, mode);
+        else
+            conns[i].fd = connect_to(argv[optind], port, socktype);
+        pfds[i].fd = conns[i].fd;
+        pfds[i].events = POLLIN;
+        if (framed) {
+            conns[i].sent_at_id = (uint64_t *)calloc(depth, sizeof(uint64_t));
+            if (conns[i].sent_at_id == NULL) {
+                perror("calloc()");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (framed) {
+        framebuf = (unsigned char *)malloc(depth * (size + FRAME_HEADER_MAX));
+        if (framebuf == NULL) {
+            perror("malloc()");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    start = now_ns();
+    deadline = start + (uint64_t)(seconds * 1e9);
+    for (i = 0; i < nconns; i++) {
+        if (framed)
+            send_frames(&conns[i], depth, depth, payload, size, framebuf);
+        else
+            send_request(&conns[i], payload, size);
+    }
+
+    while (limit ? total < limit : now_ns() < deadline) {
+        ret = 0;
+        if (busy_poll) {
+            spin_until = now_ns() + busy_poll * 1000ULL;
+            do
+                ret = poll(pfds, nconns, 0);
+            while (ret == 0 && now_ns() < spin_until);
+        }
+        if (ret == 0)
+            ret = poll(pfds, nconns, UDP_TIMEOUT_MS);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll()");
+            exit(EXIT_FAILURE);
+        }
+
+        /* A udp request or reply got lost, send it again */
+        if (ret == 0) {
+            if (socktype != SOCK_DGRAM) {
+                fprintf(stderr, "%s: no reply for %d ms\n", label, UDP_TIMEOUT_MS);
+                exit(EXIT_FAILURE);
+            }
+            for (i = 0; i < nconns; i++) {
+                lost++;
+                send_request(&conns[i], payload, size);
+            }
+            continue;
+        }
+
+        for (i = 0; i < nconns; i++) {
+            struct conn *c = &conns[i];
+
+            if (!(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+
+            /* Every reply is one record */
+            if (shm) {
+                uint64_t count;
+                uint32_t len;
+                void *p;
+
+                if (read(c->fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    perror("eventfd read()");
+                    exit(EXIT_FAILURE);
+                }
+                while ((p = shm_ring_peek(&c->rep, &len)) != NULL) {
+                    if (p == (void *)-1 || len != expected) {
+                        fprintf(stderr, "%s: bad reply record\n", label);
+                        exit(EXIT_FAILURE);
+                    }
+                    shm_ring_release(&c->rep, len);
+                    record(&lat, now_ns() - c->sent_at);
+                    total++;
+                    if (!(limit && total >= limit))
+                        send_request(c, payload, size);
+                }
+                continue;
+            }
+
+            n = recv(c->fd, reply, sizeof(reply), MSG_DONTWAIT);
+            if (n <= 0) {
+                if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                fprintf(stderr, "%s: connection closed by server\n", label);
+                exit(EXIT_FAILURE);
+            }
+
+            /* Refill the pipeline with as many as completed */
+            if (framed) {
+                done = frames_received(c, (unsigned char *)reply, n, depth, expected, &lat);
+                total += done;
+                if (limit && total >= limit)
+                    break;
+                if (done > 0)
+                    send_frames(c, done, depth, payload, size, framebuf);
+                continue;
+            }
+
+            /* A datagram is a whole reply, a stream needs all of it and
+             * a long seqpacket reply comes in several records */
+            c->got += n;
+            if (socktype != SOCK_DGRAM && c->got < expected)
+                continue;
+
+            record(&lat, now_ns() - c->sent_at);
+            total++;
+            if (limit && total >= limit)
+                break;
+            send_request(c, payload, size);
+        }
+    }
+    elapsed = now_ns() - start;
+
+    /* No replies leaves no samples, and the percentiles at 0 */
+    if (lat.count)
+        qsort(lat.ns, lat.count, sizeof(*lat.ns), cmp_u64);
+    printf("{\"bench\":\"%s\",\"proto\":\"%s\",\"mode\":\"%s\",\"size\":%zu,\"conns\":%d,\"busy_poll_us\":%d,"
+           "\"framed\":%d,\"depth\":%d,\"requests\":%zu,\"lost\":%zu,\"seconds\":%.3f,\"rps\":%.1f,"
+           "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+           label, proto, mode_name, size, nconns, busy_poll, framed, depth, total, lost, elapsed / 1e9, total * 1e9 / elapsed,
+           percentile(&lat, 50), percentile(&lat, 90), percentile(&lat, 99), percentile(&lat, 99.9),
+           percentile(&lat, 100));
+
+    for (i = 0; i < nconns; i++) {
+        if (shm)
+            close(conns[i].ctl);
+        close(conns[i].fd);
+        free(conns[i].sent_at_id);
+    }
+    free(framebuf);
+    free(lat.ns);
+    return EXIT_SUCCESS;
+}
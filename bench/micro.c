@@ -0,0 +1,200 @@
+/*
+ *    micro - microbenchmarks of the per-byte kernels used by the servers
+ *
+ *    Runs each kernel until it has used MIN_NS of cpu time and prints one
+ *    JSON line per case, so runs can be compared between commits.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "addrmap.h"
+#include "hexdump.h"
+#include "rot13.h"
+#include "sockaddr.h"
+
+#define MIN_NS          200000000ULL
+#define MAX_PAYLOAD     65507
+
+/* Keep the compiler from dropping work whose result is unused */
+#define CLOBBER()       asm volatile("" ::: "memory")
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *bench, const char *variant, size_t size, uint64_t iterations, uint64_t ns) {
+    double ns_per_op = (double)ns / iterations;
+
+    printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"size\":%zu,\"iterations\":%llu,"
+           "\"ns_per_op\":%.2f,\"mb_per_s\":%.2f}\n",
+           bench, variant, size, (unsigned long long)iterations,
+           ns_per_op, size ? size * 1000.0 / ns_per_op : 0.0);
+    fflush(stdout);
+}
+
+/*
+ *    Run body in batches of doubling size until MIN_NS have passed,
+ *    leaving the iteration count and the time taken in iterations and ns
+ */
+#define RUN(ns, iterations, body)                          \
+    do {                                                   \
+        uint64_t batch_ = 1, start_, i_;                   \
+        iterations = 0;                                    \
+        start_ = now_ns();                                 \
+        do {                                               \
+            for (i_ = 0; i_ < batch_; i_++) {              \
+                body;                                      \
+                CLOBBER();                                 \
+            }                                              \
+            iterations += batch_;                          \
+            batch_ *= 2;                                   \
+            ns = now_ns() - start_;                        \
+        } while (ns < MIN_NS);                             \
+    } while (0)
+
+static char in[MAX_PAYLOAD];
+static char out[HEXDUMP_LENGTH(MAX_PAYLOAD, 32, 8)];
+static char ref[HEXDUMP_LENGTH(MAX_PAYLOAD, 32, 8)];
+
+/* The specialized formats must match the generic one byte for byte */
+static void check_hexdump(int linelen, int split) {
+    size_t size;
+    int n, m;
+
+    for (size = 0; size <= 4 * (size_t)linelen + 1; size++) {
+        n = hexdump(out, in + 7, size, linelen, split);
+        m = hexdump_generic(ref, in + 7, size, linelen, split);
+        if (n != m || memcmp(out, ref, n + 1) != 0) {
+            fprintf(stderr, "hexdump %d/%d differs from hexdump_generic at %zu bytes\n", linelen, split, size);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void bench_hexdump(int linelen, int split) {
+    static const size_t sizes[] = { 16, 64, 512, 1500, MAX_PAYLOAD };
+    char variant[32];
+    uint64_t ns, iterations;
+    size_t i;
+
+    check_hexdump(linelen, split);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        snprintf(variant, sizeof(variant), "%d/%d", linelen, split);
+        RUN(ns, iterations, hexdump(out, in, sizes[i], linelen, split));
+        report("hexdump", variant, sizes[i], iterations, ns);
+
+        snprintf(variant, sizeof(variant), "%d/%d-generic", linelen, split);
+        RUN(ns, iterations, hexdump_generic(out, in, sizes[i], linelen, split));
+        report("hexdump", variant, sizes[i], iterations, ns);
+    }
+}
+
+static void bench_rot13(void) {
+    static const size_t sizes[] = { 64, 16384 };
+    uint64_t ns, iterations;
+    size_t i, j;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        RUN(ns, iterations,
+            for (j = 0; j < sizes[i]; j++)
+                in[j] = rot13_char(in[j]));
+        report("rot13", "char", sizes[i], iterations, ns);
+    }
+}
+
+static void bench_sockaddr(const char *variant, int family, const char *name) {
+    struct sockaddr_storage ss;
+    uint64_t ns, iterations;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = family;
+    if (family == AF_INET) {
+        inet_pton(AF_INET, name, &((struct sockaddr_in *)&ss)->sin_addr);
+        ((struct sockaddr_in *)&ss)->sin_port = htons(8000);
+    } else {
+        inet_pton(AF_INET6, name, &((struct sockaddr_in6 *)&ss)->sin6_addr);
+        ((struct sockaddr_in6 *)&ss)->sin6_port = htons(8000);
+    }
+
+    RUN(ns, iterations, sockaddr2nameport((struct sockaddr *)&ss));
+    report("sockaddr2nameport", variant, 0, iterations, ns);
+}
+
+/* Canonical form of the same addresses as bench_sockaddr() */
+static void bench_addr_key(const char *variant, int family, const char *name) {
+    struct sockaddr_storage ss;
+    struct addr_key key;
+    uint64_t ns, iterations;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = family;
+    if (family == AF_INET) {
+        inet_pton(AF_INET, name, &((struct sockaddr_in *)&ss)->sin_addr);
+        ((struct sockaddr_in *)&ss)->sin_port = htons(8000);
+    } else {
+        inet_pton(AF_INET6, name, &((struct sockaddr_in6 *)&ss)->sin6_addr);
+        ((struct sockaddr_in6 *)&ss)->sin6_port = htons(8000);
+    }
+
+    RUN(ns, iterations, (addr_key_set(&key, (struct sockaddr *)&ss, 1), addr_key_nameport(&key)));
+    report("addr_key_nameport", variant, 0, iterations, ns);
+}
+
+/* Lookups in a 3/4 full map of v4 sources, as the rate limiter does */
+static void bench_addr_map(void) {
+    static const size_t slots = 4096;
+    static struct addr_key keys[3072];
+    struct sockaddr_in sa;
+    struct addr_map m;
+    uint64_t ns, iterations;
+    size_t i, n = sizeof(keys) / sizeof(keys[0]);
+    void *mem, * volatile found;
+    int created;
+
+    mem = malloc(ADDR_MAP_SIZE(slots, sizeof(uint64_t)));
+    addr_map_init(&m, mem, slots, sizeof(uint64_t));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    for (i = 0; i < n; i++) {
+        sa.sin_addr.s_addr = htonl(0xc0000200 + i * 7);
+        addr_key_set(&keys[i], (struct sockaddr *)&sa, 0);
+        addr_map_insert(&m, &keys[i], &created);
+    }
+
+    i = 0;
+    RUN(ns, iterations, (found = addr_map_find(&m, &keys[i]), i = (i + 1) % n));
+    (void)found;
+    report("addr_map_find", "3/4 full", 0, iterations, ns);
+    free(mem);
+}
+
+int main(int argc, char *argv[]) {
+    size_t i;
+
+    (void)argc;
+    (void)argv;
+
+    /* Mostly printable text with some binary, like the README over netcat */
+    srand(1);
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = (rand() % 8) ? ' ' + rand() % 95 : rand() % 256;
+
+    bench_hexdump(16, 8);
+    bench_hexdump(32, 8);
+    bench_rot13();
+    bench_sockaddr("v4", AF_INET, "192.0.2.1");
+    bench_sockaddr("v6", AF_INET6, "2001:db8::1");
+    bench_sockaddr("v4mapped", AF_INET6, "::ffff:192.0.2.1");
+    bench_addr_key("v4", AF_INET, "192.0.2.1");
+    bench_addr_key("v6", AF_INET6, "2001:db8::1");
+    bench_addr_key("v4mapped", AF_INET6, "::ffff:192.0.2.1");
+    bench_addr_map();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,355 @@
+/*
+ *    replay - send the traffic in a server -C capture file to a server again
+ *
+ *    Walks the records of the capture ring oldest first and sends each
+ *    payload to host port, spaced as recorded divided by -x speed (0 sends
+ *    as fast as possible). Records due at the same time go out together:
+ *    udp datagrams with one sendmmsg(), consecutive reads of a tcp
+ *    connection with one writev(). Every recorded tcp connection gets its
+ *    own connection. Replies are read and counted, not checked. Prints one
+ *    JSON line like loadgen. With -t all, a capture that lost all of one
+ *    protocol to ring eviction is refused rather than replayed as mixed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "capture.h"
+
+#define MAX_CONNS       1024
+#define MAX_BATCH       1024
+#define DRAIN_IDLE_MS   200
+
+/* A recorded tcp connection and the one replaying it */
+struct conn {
+    uint32_t conn;
+    uint8_t family;
+    uint16_t port;
+    uint8_t addr[16];
+    int fd;
+};
+
+struct target {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family;
+};
+
+static struct conn conns[MAX_CONNS];
+static int nconns;
+static struct pollfd pfds[MAX_CONNS + 1];
+static size_t reply_bytes;
+static char reply[65536];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void resolve(const char *host, const char *port, struct target *t) {
+    struct addrinfo hints, *result;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&t->addr, result->ai_addr, result->ai_addrlen);
+    t->addrlen = result->ai_addrlen;
+    t->family = result->ai_family;
+    freeaddrinfo(result);
+}
+
+static int open_socket(struct target *t, int socktype) {
+    int fd, one = 1;
+
+    fd = socket(t->family, socktype | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, (struct sockaddr *)&t->addr, t->addrlen) == -1 && errno != EINPROGRESS) {
+        perror("connect()");
+        exit(EXIT_FAILURE);
+    }
+    if (socktype == SOCK_STREAM)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* The connection replaying the recorded one of r, opened on first use */
+static struct conn *conn_for(const struct capture_record *r, struct target *t) {
+    static struct conn *last;
+    struct conn *c;
+    int i;
+
+    /* Reads of one connection tend to come in runs */
+    if (last && last->conn == r->conn && last->port == r->port && memcmp(last->addr, r->addr, 16) == 0)
+        return last;
+
+    for (i = 0; i < nconns; i++) {
+        c = &conns[i];
+        if (c->conn == r->conn && c->port == r->port && memcmp(c->addr, r->addr, 16) == 0)
+            return last = c;
+    }
+
+    if (nconns == MAX_CONNS) {
+        fprintf(stderr, "More than %d tcp connections in the capture\n", MAX_CONNS);
+        exit(EXIT_FAILURE);
+    }
+    c = &conns[nconns];
+    c->conn = r->conn;
+    c->family = r->family;
+    c->port = r->port;
+    memcpy(c->addr, r->addr, 16);
+    c->fd = open_socket(t, SOCK_STREAM);
+    pfds[nconns].fd = c->fd;
+    pfds[nconns].events = POLLIN;
+    nconns++;
+    return last = c;
+}
+
+/* Read whatever replies are there on the udp socket and the connections */
+static int drain_replies(int udpfd, int timeout_ms) {
+    int i, n, ret;
+    ssize_t got;
+
+    pfds[nconns].fd = udpfd;
+    pfds[nconns].events = POLLIN;
+    ret = poll(pfds, nconns + 1, timeout_ms);
+    if (ret <= 0)
+        return 0;
+
+    for (i = 0, n = 0; i <= nconns; i++) {
+        if (!(pfds[i].revents & POLLIN))
+            continue;
+        while ((got = recv(pfds[i].fd, reply, sizeof(reply), MSG_DONTWAIT)) > 0) {
+            reply_bytes += got;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Write all of iov to a nonblocking connection, reading replies while it is full */
+static void send_all(int fd, int udpfd, struct iovec *iov, int iovcnt) {
+    struct pollfd pfd;
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("writev()");
+                exit(EXIT_FAILURE);
+            }
+            drain_replies(udpfd, 0);
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, 10);
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+static void send_datagrams(int udpfd, struct mmsghdr *msgs, int count) {
+    int sent = 0, ret;
+
+    while (sent < count) {
+        ret = sendmmsg(udpfd, msgs + sent, count - sent, 0);
+        if (ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                drain_replies(udpfd, 1);
+                continue;
+            }
+            perror("sendmmsg()");
+            exit(EXIT_FAILURE);
+        }
+        sent += ret;
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-x speed] [-t tcp|udp|all] [-b batch] [-l label] capture.ring host port\n"
+            "\tspeed 1 replays as recorded, 0 as fast as possible\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    static struct mmsghdr msgs[MAX_BATCH];
+    static struct iovec udp_iov[MAX_BATCH], tcp_iov[MAX_BATCH];
+    const char *label = "replay", *only = "all";
+    struct capture_header *h;
+    struct capture_record *r;
+    struct conn *tcp_conn = NULL;
+    struct target target;
+    struct stat st;
+    double speed = 1;
+    int fd, udpfd, opt, batch = 32, nudp = 0, ntcp = 0;
+    uint64_t offset, head, first_ts = 0, start, due, now, elapsed;
+    size_t records = 0, bytes = 0, udp_records = 0, tcp_records = 0;
+
+    while ((opt = getopt(argc, argv, "x:t:b:l:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = atof(optarg);
+            if (speed < 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            only = optarg;
+            if (strcmp(only, "tcp") != 0 && strcmp(only, "udp") != 0 && strcmp(only, "all") != 0)
+                usage(argv[0]);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            if (batch < 1 || batch > MAX_BATCH)
+                usage(argv[0]);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    h = (struct capture_header *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror("mmap()");
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size < CAPTURE_DATA || h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION ||
+            (uint64_t)st.st_size != CAPTURE_DATA + h->size) {
+        fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    resolve(argv[optind + 1], argv[optind + 2], &target);
+    udpfd = open_socket(&target, SOCK_DGRAM);
+
+    /* Up to what was written when we started, the server may still be going */
+    head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+    if (strcmp(only, "all") == 0) {
+        for (offset = h->tail; offset < head; offset += r->length) {
+            r = capture_at(h, offset);
+            if (capture_is_pad(r))
+                continue;
+            if (r->proto == CAPTURE_UDP)
+                udp_records++;
+            else
+                tcp_records++;
+        }
+        if (udp_records == 0 || tcp_records == 0) {
+            fprintf(stderr, "%s has no %s records left (%llu dropped), use -t %s or a larger -Z\n",
+                    argv[optind], udp_records ? "tcp" : "udp", (unsigned long long)h->dropped,
+                    udp_records ? "udp" : "tcp");
+            exit(EXIT_FAILURE);
+        }
+        udp_records = tcp_records = 0;
+    }
+    start = now_ns();
+
+    for (offset = h->tail; offset < head || nudp || ntcp; offset += r ? r->length : 0) {
+        r = NULL;
+        if (offset < head) {
+            r = capture_at(h, offset);
+            if (capture_is_pad(r))
+                continue;
+            if ((r->proto == CAPTURE_UDP && strcmp(only, "tcp") == 0) ||
+                    (r->proto == CAPTURE_TCP && strcmp(only, "udp") == 0))
+                continue;
+            if (first_ts == 0)
+                first_ts = r->ts;
+        }
+
+        /* Send what is batched when this record is not due yet, belongs to
+         * another connection, fills a batch, or there are no more */
+        due = (r && speed > 0) ? start + (uint64_t)((r->ts - first_ts) / speed) : 0;
+        if (r == NULL || due > now_ns() || nudp == batch || ntcp == batch ||
+                (ntcp && r->proto == CAPTURE_TCP && conn_for(r, &target) != tcp_conn)) {
+            if (nudp)
+                send_datagrams(udpfd, msgs, nudp);
+            if (ntcp)
+                send_all(tcp_conn->fd, udpfd, tcp_iov, ntcp);
+            nudp = ntcp = 0;
+            drain_replies(udpfd, 0);
+        }
+        if (r == NULL)
+            break;
+
+        /* Wait for it, reading replies meanwhile */
+        while (due > (now = now_ns()))
+            drain_replies(udpfd, (int)((due - now) / 1000000));
+
+        if (r->proto == CAPTURE_UDP) {
+            udp_iov[nudp].iov_base = r + 1;
+            udp_iov[nudp].iov_len = r->caplen;
+            memset(&msgs[nudp], 0, sizeof(msgs[nudp]));
+            msgs[nudp].msg_hdr.msg_iov = &udp_iov[nudp];
+            msgs[nudp].msg_hdr.msg_iovlen = 1;
+            nudp++;
+            udp_records++;
+        } else {
+            tcp_conn = conn_for(r, &target);
+            tcp_iov[ntcp].iov_base = r + 1;
+            tcp_iov[ntcp].iov_len = r->caplen;
+            ntcp++;
+            tcp_records++;
+        }
+        records++;
+        bytes += r->caplen;
+    }
+
+    /* Rates are of the sending, then collect the replies still coming */
+    elapsed = now_ns() - start;
+    while (drain_replies(udpfd, DRAIN_IDLE_MS) > 0)
+        ;
+
+    printf("{\"bench\":\"%s\",\"proto\":\"%s\",\"speed\":%g,\"batch\":%d,\"records\":%zu,\"udp\":%zu,\"tcp\":%zu,"
+           "\"conns\":%d,\"bytes\":%zu,\"reply_bytes\":%zu,\"dropped\":%llu,\"seconds\":%.3f,\"rps\":%.1f,\"mb_per_s\":%.2f}\n",
+           label, only, speed, batch, records, udp_records, tcp_records, nconns, bytes, reply_bytes,
+           (unsigned long long)h->dropped, elapsed / 1e9, records * 1e9 / elapsed, bytes * 1e3 / elapsed);
+
+    for (fd = 0; fd < nconns; fd++)
+        close(conns[fd].fd);
+    close(udpfd);
+    munmap(h, st.st_size);
+    return EXIT_SUCCESS;
+}
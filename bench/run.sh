@@ -0,0 +1,162 @@
+#!/bin/sh
+#
+#    run.sh - run the microbenchmarks and drive every server in the repo over
+#    loopback with bench/loadgen. Every result is one JSON line tagged with
+#    the commit, appended to $OUT/<commit>.jsonl. Compare two runs with
+#    bench/compare.sh.
+#
+#    BIN       where the programs were built (default build/release)
+#    OUT       where results go (default build/bench)
+#    DURATION  seconds per loadgen run (default 2)
+#    PORT      first loopback port to use (default 18000)
+
+set -e
+
+BIN=${BIN:-build/release}
+OUT=${OUT:-build/bench}
+DURATION=${DURATION:-2}
+PORT=${PORT:-18000}
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+git diff --quiet HEAD 2>/dev/null || commit="$commit-dirty"
+mkdir -p "$OUT"
+results="$OUT/$commit.jsonl"
+server_pid=
+
+tag() {
+    sed "s/^{/{\"commit\":\"$commit\",/" | tee -a "$results"
+}
+
+start_server() {
+    "$@" > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 0.5
+}
+
+stop_server() {
+    kill $server_pid 2>/dev/null || true
+    wait $server_pid 2>/dev/null || true
+    server_pid=
+}
+
+trap stop_server EXIT
+
+loadgen() {
+    "$BIN/bench/loadgen" -d "$DURATION" "$@" | tag
+}
+
+echo "Results: $results"
+
+"$BIN/bench/micro" | tag
+
+# server: hexdump over tcp and udp
+start_server "$BIN/server" ::1 $PORT
+for size in 64 1500; do
+    loadgen -l server-tcp -t tcp -m hexdump -s $size -c 1 ::1 $PORT
+    loadgen -l server-tcp -t tcp -m hexdump -s $size -c 8 ::1 $PORT
+    loadgen -l server-udp -t udp -m hexdump -s $size -c 1 ::1 $PORT
+done
+stop_server
+
+# server: udp round trip with and without busy polling on both ends
+start_server "$BIN/server" ::1 $PORT
+loadgen -l server-udp-latency -t udp -m hexdump -s 64 -c 1 ::1 $PORT
+stop_server
+start_server "$BIN/server" -P 50 ::1 $PORT
+loadgen -l server-udp-latency -t udp -m hexdump -s 64 -c 1 -B 50 ::1 $PORT
+stop_server
+
+# server: framed protocol, one request in flight against a pipeline of 64
+start_server "$BIN/server" -F ::1 $PORT
+for depth in 1 64; do
+    loadgen -l server-framed -t tcp -m hexdump -s 64 -c 1 -f -p $depth ::1 $PORT
+done
+stop_server
+
+# server: requests split over loop iterations by a small quantum, and small
+# ones from enough clients to make the workers coalesce
+start_server "$BIN/server" -q 2048 ::1 $PORT
+loadgen -l server-coalesce -t tcp -m hexdump -s 30000 -c 1 ::1 $PORT
+loadgen -l server-coalesce -t tcp -m hexdump -s 64 -c 8 ::1 $PORT
+stop_server
+
+# server: the same payloads over loopback tcp/udp and unix domain sockets; the
+# hexdump of 16384 bytes (~80K) does not fit in a udp datagram
+sock="$OUT/server.sock"
+start_server "$BIN/server" -u "unix:$sock" -u unixpacket:@server-bench ::1 $PORT
+for size in 64 1500 16384; do
+    loadgen -l server-transport -t tcp -m hexdump -s $size -c 4 ::1 $PORT
+    if [ $size -lt 16384 ]; then
+        loadgen -l server-transport -t udp -m hexdump -s $size -c 4 ::1 $PORT
+    fi
+    loadgen -l server-transport -m hexdump -s $size -c 4 "unix:$sock"
+    loadgen -l server-transport -m hexdump -s $size -c 4 unixpacket:@server-bench
+done
+stop_server
+
+# server: shared memory rings against unix and tcp sockets, one client and four
+start_server "$BIN/server" -m unix:@server-shm -u unix:@server-uds ::1 $PORT
+for size in 64 1500 16384; do
+    for conns in 1 4; do
+        loadgen -l server-shm -m hexdump -s $size -c $conns shm:unix:@server-shm
+        loadgen -l server-shm -m hexdump -s $size -c $conns unix:@server-uds
+        loadgen -l server-shm -t tcp -m hexdump -s $size -c $conns ::1 $PORT
+    done
+done
+loadgen -l server-shm -m echo -s 1500 -c 4 shm:unix:@server-shm
+loadgen -l server-shm -m rot13 -s 1500 -c 4 shm:unix:@server-shm
+stop_server
+
+# server: small requests next to 60K ones, dumped in the loop and in the pool
+for pool in 0 2; do
+    start_server "$BIN/server" -j $pool ::1 $PORT
+    "$BIN/bench/loadgen" -d "$DURATION" -t tcp -m hexdump -s 60000 -c 4 ::1 $PORT > /dev/null &
+    loadgen -l server-offload-j$pool -t tcp -m hexdump -s 64 -c 4 ::1 $PORT
+    wait $!
+    stop_server
+done
+
+# server: record a mixed udp/tcp run, then replay it as fast as possible. The
+# runs are counted, not timed: about 35M of requests, so the tcp ones cannot
+# evict the udp ones from the 64M ring
+capture="$OUT/capture.ring"
+rm -f "$capture"
+start_server "$BIN/server" -C "$capture" -Z 64 ::1 $PORT
+"$BIN/bench/loadgen" -n 20000 -t udp -m hexdump -s 200 -c 1 ::1 $PORT > /dev/null
+"$BIN/bench/loadgen" -n 20000 -t tcp -m hexdump -s 1500 -c 4 ::1 $PORT > /dev/null
+stop_server
+start_server "$BIN/server" ::1 $PORT
+"$BIN/bench/replay" -l server-replay -x 0 "$capture" ::1 $PORT | tag
+stop_server
+
+# server: exec to ready, to the first reply, and SIGTERM to exit
+for workers in 1 4; do
+    "$BIN/bench/startup" -n 20 -l server-startup-w$workers ::1 $PORT -- \
+        "$BIN/server" -w $workers ::1 $PORT | tag
+done
+
+# rot13-event: line based rot13 on its fixed port
+start_server "$BIN/rot13-event"
+for size in 64 1024; do
+    loadgen -l rot13-event -t tcp -m rot13 -s $size -c 1 127.0.0.1 40713
+    loadgen -l rot13-event -t tcp -m rot13 -s $size -c 8 127.0.0.1 40713
+done
+stop_server
+
+# coro-server: the same hexdump and rot13 protocols on coroutines
+start_server "$BIN/coro-server" ::1 $((PORT + 2)) $((PORT + 3))
+for size in 64 1500; do
+    loadgen -l coro-server -t tcp -m hexdump -s $size -c 8 ::1 $((PORT + 2))
+done
+loadgen -l coro-server -t tcp -m rot13 -s 64 -c 8 ::1 $((PORT + 3))
+stop_server
+
+# getaddrinfo-server: udp echo, at most 500 bytes
+start_server "$BIN/getaddrinfo-server" ::1 $((PORT + 1))
+loadgen -l getaddrinfo-server -t udp -m echo -s 64 -c 1 ::1 $((PORT + 1))
+stop_server
+
+# test: serves a single 250 byte echo on its fixed port, then exits
+start_server "$BIN/test"
+loadgen -l test -t tcp -m echo -s 250 -c 1 -n 1 ::1 3005
+stop_server
@@ -0,0 +1,217 @@
+/*
+ *    startup - time a server from exec to ready, to its first reply, and
+ *    from SIGTERM to exit
+ *
+ *    Runs the command after -- n times. Each run passes an abstract
+ *    NOTIFY_SOCKET and waits for READY=1. Then it connects to host port
+ *    until the server takes the connection, sends a line and waits for the
+ *    first byte back. The time to that byte is the time to the first
+ *    accept: a reply means the connection left the backlog. The probe
+ *    disconnects before the server gets SIGTERM, so the stop time is the
+ *    drain with no clients left. A server that never notifies gets a ready
+ *    time of -1. Prints the medians and the worst first reply as one JSON
+ *    line, like loadgen.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#define MAX_RUNS        1000
+#define TIMEOUT_NS      5000000000ULL   /* to ready, first reply or exit */
+#define RETRY_US        100             /* between refused connects */
+
+enum phase {
+    READY,
+    CONNECT,
+    FIRST_REPLY,
+    STOP,
+    PHASES,
+};
+
+static const char *phase_names[PHASES] = { "ready_ms", "connect_ms", "first_reply_ms", "stop_ms" };
+static double samples[PHASES][MAX_RUNS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "startup: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+/* Wait for READY=1 on the notify socket, returns 0 on time */
+static int wait_ready(int nfd, uint64_t deadline) {
+    struct pollfd pfd;
+    char msg[256];
+    ssize_t n;
+    uint64_t now;
+
+    pfd.fd = nfd;
+    pfd.events = POLLIN;
+    while ((now = now_ns()) < deadline) {
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) <= 0)
+            continue;
+        n = recv(nfd, msg, sizeof(msg) - 1, 0);
+        if (n <= 0)
+            continue;
+        msg[n] = '\0';
+        if (strncmp(msg, "READY=1", 7) == 0 || strstr(msg, "\nREADY=1"))
+            return 0;
+    }
+    return -1;
+}
+
+/* Connect until the server listens, returns the connected fd */
+static int connect_retry(const struct addrinfo *ai, uint64_t deadline) {
+    int fd;
+
+    while (now_ns() < deadline) {
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            fail("socket()");
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            return fd;
+        close(fd);
+        if (errno != ECONNREFUSED)
+            fail("connect()");
+        usleep(RETRY_US);
+    }
+    return -1;
+}
+
+/* Wait for the child to exit, returns 0 on time */
+static int wait_exit(pid_t pid, uint64_t deadline) {
+    int status;
+
+    while (now_ns() < deadline) {
+        if (waitpid(pid, &status, WNOHANG) == pid)
+            return 0;
+        usleep(RETRY_US);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n runs] [-l label] host port -- command [args...]\n"
+            "\texample -n 20 ::1 8000 -- build/release/server -w 4 ::1 8000\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *label = "startup";
+    struct addrinfo hints, *ai;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    char name[64], env[80], c;
+    uint64_t start, deadline;
+    int runs = 10, opt, run, phase, nfd, fd, devnull, ret;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1 || runs > MAX_RUNS)
+                usage(argv[0]);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    /* getopt() skips the --, host and port end up first */
+    if (argc - optind < 3)
+        usage(argv[0]);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ret = getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai);
+    if (ret != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Abstract, nothing to clean up */
+    snprintf(name, sizeof(name), "startup-%d", (int)getpid());
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path + 1, name, strlen(name));
+    addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+    nfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (nfd == -1 || bind(nfd, (struct sockaddr *)&addr, addrlen) == -1)
+        fail("notify socket");
+    snprintf(env, sizeof(env), "NOTIFY_SOCKET=@%s", name);
+    putenv(env);
+
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for (run = 0; run < runs; run++) {
+        start = now_ns();
+        deadline = start + TIMEOUT_NS;
+        pid = fork();
+        if (pid == -1)
+            fail("fork()");
+        if (pid == 0) {
+            dup2(devnull, STDOUT_FILENO);
+            execvp(argv[optind + 2], argv + optind + 2);
+            perror(argv[optind + 2]);
+            _exit(127);
+        }
+
+        samples[READY][run] = (wait_ready(nfd, deadline) == 0) ? (now_ns() - start) / 1e6 : -1;
+        /* Without a notification we have waited the whole timeout */
+        if (samples[READY][run] < 0)
+            deadline = now_ns() + TIMEOUT_NS;
+
+        fd = connect_retry(ai, deadline);
+        if (fd == -1)
+            fail("server never listened");
+        samples[CONNECT][run] = (now_ns() - start) / 1e6;
+        if (write(fd, "startup\n", 8) != 8 || read(fd, &c, 1) != 1)
+            fail("no reply");
+        samples[FIRST_REPLY][run] = (now_ns() - start) / 1e6;
+        close(fd);
+
+        start = now_ns();
+        kill(pid, SIGTERM);
+        samples[STOP][run] = (wait_exit(pid, start + TIMEOUT_NS) == 0) ? (now_ns() - start) / 1e6 : -1;
+    }
+
+    printf("{\"bench\":\"%s\",\"runs\":%d", label, runs);
+    for (phase = 0; phase < PHASES; phase++) {
+        qsort(samples[phase], runs, sizeof(double), cmp_double);
+        printf(",\"%s\":%.3f", phase_names[phase], samples[phase][runs / 2]);
+    }
+    printf(",\"first_reply_max_ms\":%.3f}\n", samples[FIRST_REPLY][runs - 1]);
+
+    freeaddrinfo(ai);
+    close(nfd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *    Capture file
+ *
+ *    A capture_header followed by a ring of size bytes holding records.
+ *    Offsets head and tail count bytes ever written, the record at offset o
+ *    sits at CAPTURE_DATA + o % size. A record never wraps around the end
+ *    of the ring; the space it would not fit in becomes a pad record. When
+ *    the ring is full the oldest records are dropped by advancing tail, so
+ *    the records from tail to head are always complete and in order.
+ */
+
+#define CAPTURE_MAGIC      0x50414348   /* "HCAP" */
+#define CAPTURE_VERSION    1
+#define CAPTURE_DATA       64           /* ring offset in the file */
+#define CAPTURE_ALIGN      8
+
+enum capture_proto {
+    CAPTURE_PAD = 0,
+    CAPTURE_UDP,
+    CAPTURE_TCP,
+};
+
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;                  /* bytes in the ring */
+    uint64_t head;                  /* offset of the next record */
+    uint64_t tail;                  /* offset of the oldest record */
+    uint64_t records;               /* ever written */
+    uint64_t dropped;               /* overwritten when the ring was full */
+};
+
+struct capture_record {
+    uint32_t length;                /* bytes of the record, padding included */
+    uint32_t caplen;                /* payload bytes following the record */
+    uint64_t ts;                    /* realtime ns of the read */
+    uint32_t conn;                  /* tcp: fd of the connection, udp: 0 */
+    uint8_t proto;                  /* enum capture_proto */
+    uint8_t family;                 /* of the peer */
+    uint16_t port;                  /* of the peer, network order */
+    uint8_t addr[16];               /* of the peer, v4 in the first 4 bytes */
+};
+
+/* Record length for caplen payload bytes */
+#define CAPTURE_RECORD_LENGTH(caplen) \
+    ((sizeof(struct capture_record) + (caplen) + CAPTURE_ALIGN - 1) & ~(size_t)(CAPTURE_ALIGN - 1))
+
+/* The record at offset in the ring of h */
+static inline struct capture_record *capture_at(struct capture_header *h, uint64_t offset) {
+    return (struct capture_record *)((char *)h + CAPTURE_DATA + offset % h->size);
+}
+
+/* A pad record may be too short to hold more than its length */
+static inline int capture_is_pad(const struct capture_record *r) {
+    return r->length < sizeof(*r) || r->proto == CAPTURE_PAD;
+}
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,69 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *    Framed protocol
+ *
+ *    A frame is varint(payload length) varint(request id) payload, with
+ *    LEB128 varints: 7 bits per byte, least significant group first, high
+ *    bit set on every byte but the last. A reply carries the id of its
+ *    request, so a client can keep many requests in flight on one stream.
+ */
+
+#define VARINT_MAX         10
+#define FRAME_HEADER_MAX   (2 * VARINT_MAX)
+
+/* Encode v into out, returns the bytes used */
+static inline int varint_encode(uint64_t v, unsigned char *out) {
+    int n = 0;
+
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Decode a varint from p, returns the bytes used, 0 if incomplete, -1 if invalid */
+static inline int varint_decode(const unsigned char *p, size_t len, uint64_t *v) {
+    uint64_t result = 0;
+    size_t i;
+
+    for (i = 0; i < len && i < VARINT_MAX; i++) {
+        result |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = result;
+            return i + 1;
+        }
+    }
+    return (i == VARINT_MAX) ? -1 : 0;
+}
+
+/* Encode a frame header into out, returns the bytes used */
+static inline int frame_header_encode(uint64_t length, uint64_t id, unsigned char *out) {
+    int n = varint_encode(length, out);
+
+    return n + varint_encode(id, out + n);
+}
+
+/*
+ *    Decode a frame header from p, returns the header length, 0 if more
+ *    bytes are needed, -1 if the header is invalid
+ */
+static inline int frame_header_decode(const unsigned char *p, size_t len, uint64_t *length, uint64_t *id) {
+    int n, m;
+
+    n = varint_decode(p, len, length);
+    if (n <= 0)
+        return n;
+    m = varint_decode(p + n, len - n, id);
+    if (m <= 0)
+        return m;
+    return n + m;
+}
+
+#endif /* FRAME_H */
@@ -6,21 +6,43 @@
 #include <unistd.h>
 #include <string.h>
 
+#include "sockaddr.h"
+
 #define BUF_SIZE 500
 
 int
 main(int argc, char *argv[]) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
-    int sfd, s;
+    struct sockaddr_un sun;
+    socklen_t sunlen;
+    int sfd, s, socktype, first = 3;
     size_t len;
     ssize_t nread;
     char buf[BUF_SIZE];
 
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s host port msg...\n", argv[0]);
+        fprintf(stderr, "Usage: %s host port msg...\n"
+                "       %s unix:/path|unix:@name|unixpacket:/path|unixpacket:@name msg...\n",
+                argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Unix domain endpoint, no port and no lookup */
+    s = unix_endpoint(argv[1], &sun, &sunlen, &socktype);
+    if (s == -1) {
+        fprintf(stderr, "Bad unix endpoint: %s\n", argv[1]);
         exit(EXIT_FAILURE);
     }
+    if (s == 1) {
+        sfd = socket(AF_UNIX, socktype, 0);
+        if (sfd == -1 || connect(sfd, (struct sockaddr *)&sun, sunlen) == -1) {
+            perror(argv[1]);
+            exit(EXIT_FAILURE);
+        }
+        first = 2;
+        goto connected;
+    }
 
     /* Obtain address(es) matching host/port. */
 
@@ -60,10 +82,11 @@ main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+connected:
     /* Send remaining command-line arguments as separate
        datagrams, and read responses from server. */
 
-    for (int j = 3; j < argc; j++) {
+    for (int j = first; j < argc; j++) {
         len = strlen(argv[j]) + 1;
         /* +1 for terminating null byte */
 
@@ -0,0 +1,242 @@
+#ifndef HEXDUMP_H
+#define HEXDUMP_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ *    Size of the hexdump() output for length bytes, including the closing \0
+ *
+ *    per line: hex/ascii gap (2 chars) + newline (1 char)
+ *    split = 4 chars (2 each for hex/ascii) * number of splits
+ *    (hex = 3 chars, ascii = 1 char) * linelen number of chars
+ */
+#define HEXDUMP_LENGTH(length, linelen, split) \
+    (((length) + (linelen) - 1) / (linelen) * \
+     (3 + 4 * (((linelen) - 1) / (split)) + 4 * (linelen)) + 1)
+
+/*
+ *    hexdump_generic - output a hex dump of a buffer, any line format
+ *
+ *    buffer receives the dump, HEXDUMP_LENGTH(length, linelen, split) bytes
+ *    data is pointer to the buffer
+ *    length is length of buffer to convert
+ *    linelen is number of chars to output per line
+ *    split is number of chars in each chunk on a line
+ */
+static inline int hexdump_generic(char *buffer, void const *data, size_t length, int linelen, int split) {
+    char *ptr;
+    const char *inptr;
+    int pos;
+    int remaining = length;
+
+    inptr = (char *)data;
+
+    assert(linelen > 0 && split > 0);
+
+    /*
+     *    Loop through each line remaining
+     */
+    ptr = buffer;
+    while (remaining > 0) {
+        int lrem;
+        int splitcount;
+
+        /*
+         *    Loop through the hex chars of this line
+         */
+        lrem = remaining;
+        splitcount = 0;
+        for (pos = 0; pos < linelen; pos++) {
+
+            /* Split hex section if required */
+            if (split == splitcount++) {
+                ptr += sprintf(ptr, "  ");
+                splitcount = 1;
+            }
+
+            /* If remaining chars, output, else leave a space */
+            if (lrem) {
+                ptr += sprintf(ptr, "%.2x ", *((unsigned char *) inptr + pos));
+                lrem--;
+            } else
+                ptr += sprintf(ptr, "   ");
+        }
+
+        *ptr++ = ' ';
+        *ptr++ = ' ';
+
+        /*
+         *    Loop through the ASCII chars of this line
+         */
+        lrem = remaining;
+        splitcount = 0;
+        for (pos = 0; pos < linelen; pos++) {
+            unsigned char c;
+
+            /* Split ASCII section if required */
+            if (split == splitcount++) {
+                ptr += sprintf(ptr, "  ");
+                splitcount = 1;
+            }
+
+            if (lrem) {
+                c = *((unsigned char *) inptr + pos);
+                if (c > 31 && c < 127)
+                    ptr += sprintf(ptr, "%c", c);
+
+                else
+                    ptr += sprintf(ptr, ".");
+                lrem--;
+            }
+        }
+
+        *ptr++ = '\n';
+        inptr += linelen;
+        remaining -= linelen;
+    }
+
+    *ptr = '\0';
+
+    return ptr - buffer;
+}
+
+#ifdef __cplusplus
+#include <stdint.h>
+#include <utility>
+
+/*
+ *    hexdump_format - a hexdump with the line format fixed at compile time
+ *
+ *    LineLen bytes per line in groups of Split, optionally prefixed with an
+ *    8 digit offset column, hex digits in lower or Upper case. The column of
+ *    every byte is worked out at compile time; each line is a copy of a
+ *    blank line with the hex pairs and characters stored into it, the loop
+ *    over a line unrolled. Without Offset and Upper the output is the same
+ *    as hexdump_generic().
+ */
+namespace hexdump_detail {
+
+struct tables {
+    char pair[256][2];              /* hex digits of each byte */
+    char print[256];                /* the byte or '.' */
+
+    constexpr tables(bool upper) : pair(), print() {
+        const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+
+        for (int c = 0; c < 256; c++) {
+            pair[c][0] = digits[c >> 4];
+            pair[c][1] = digits[c & 15];
+            print[c] = (c > 31 && c < 127) ? (char)c : '.';
+        }
+    }
+};
+
+template <bool Upper>
+struct table {
+    static constexpr tables value{Upper};
+};
+
+template <int LineLen, int Split, bool Offset>
+struct layout {
+    static constexpr int splits = (LineLen - 1) / Split;
+    static constexpr int prefix = Offset ? 10 : 0;
+    static constexpr int ascii_start = prefix + 3 * LineLen + 2 * splits + 2;
+    static constexpr int line = ascii_start + LineLen + 2 * splits + 1;
+
+    int hex[LineLen];               /* column of the hex pair of byte i */
+    int ascii[LineLen];             /* column of the character of byte i */
+    char blank[line];               /* a line of spaces and its newline */
+
+    constexpr layout() : hex(), ascii(), blank() {
+        for (int i = 0; i < line - 1; i++)
+            blank[i] = ' ';
+        blank[line - 1] = '\n';
+        for (int i = 0; i < LineLen; i++) {
+            hex[i] = prefix + 3 * i + 2 * (i / Split);
+            ascii[i] = ascii_start + i + 2 * (i / Split);
+        }
+    }
+};
+
+} /* namespace hexdump_detail */
+
+template <int LineLen, int Split, bool Offset = false, bool Upper = false>
+struct hexdump_format {
+    static_assert(LineLen > 0 && Split > 0, "bad hexdump format");
+
+    typedef hexdump_detail::layout<LineLen, Split, Offset> layout_type;
+    static constexpr layout_type layout{};
+    static constexpr const hexdump_detail::tables &tab = hexdump_detail::table<Upper>::value;
+
+    /* Size of the output for length bytes, including the closing \0 */
+    static constexpr size_t length(size_t length) {
+        return (length + LineLen - 1) / LineLen * layout_type::line + 1;
+    }
+
+    static void put_offset(char *out, size_t offset) {
+        if (Offset) {
+            memcpy(out, tab.pair[(offset >> 24) & 0xff], 2);
+            memcpy(out + 2, tab.pair[(offset >> 16) & 0xff], 2);
+            memcpy(out + 4, tab.pair[(offset >> 8) & 0xff], 2);
+            memcpy(out + 6, tab.pair[offset & 0xff], 2);
+        }
+    }
+
+    static void put_byte(char *out, const unsigned char *in, int i) {
+        memcpy(out + layout.hex[i], tab.pair[in[i]], 2);
+        out[layout.ascii[i]] = tab.print[in[i]];
+    }
+
+    template <size_t... I>
+    static void put_line(char *out, const unsigned char *in, std::index_sequence<I...>) {
+        (put_byte(out, in, I), ...);
+    }
+
+    static int dump(char *buffer, void const *data, size_t length) {
+        const unsigned char *in = (const unsigned char *)data;
+        char *ptr = buffer;
+        size_t offset = 0, n, i;
+
+        for (; length - offset >= (size_t)LineLen; offset += LineLen) {
+            memcpy(ptr, layout.blank, layout_type::line);
+            put_offset(ptr, offset);
+            put_line(ptr, in + offset, std::make_index_sequence<LineLen>());
+            ptr += layout_type::line;
+        }
+
+        /* The last line has no characters past the data, only the gaps */
+        if (offset < length) {
+            n = length - offset;
+            memcpy(ptr, layout.blank, layout_type::line);
+            put_offset(ptr, offset);
+            for (i = 0; i < n; i++)
+                put_byte(ptr, in + offset, i);
+            ptr += layout_type::ascii_start + n + 2 * layout_type::splits;
+            *ptr++ = '\n';
+        }
+
+        *ptr = '\0';
+        return ptr - buffer;
+    }
+};
+
+/*
+ *    hexdump - output a hex dump of a buffer
+ *
+ *    Same arguments as hexdump_generic(); the formats the servers use run
+ *    the compile time specialized version.
+ */
+static inline int hexdump(char *buffer, void const *data, size_t length, int linelen, int split) {
+    if (linelen == 16 && split == 8)
+        return hexdump_format<16, 8>::dump(buffer, data, length);
+    if (linelen == 32 && split == 8)
+        return hexdump_format<32, 8>::dump(buffer, data, length);
+    return hexdump_generic(buffer, data, length, linelen, split);
+}
+#else
+#define hexdump hexdump_generic
+#endif /* __cplusplus */
+
+#endif /* HEXDUMP_H */
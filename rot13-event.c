@@ -4,6 +4,8 @@
 #include <sys/socket.h>
 /* For fcntl */
 #include <fcntl.h>
+/* For eventfd */
+#include <sys/eventfd.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -16,62 +18,200 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include "rot13.h"
+#include "workpool.h"
+
 #define MAX_LINE 16384
+#define OFFLOAD_MIN 8192
 
 void do_read(evutil_socket_t fd, short events, void *arg);
 void do_write(evutil_socket_t fd, short events, void *arg);
 
-char
-rot13_char(char c)
+struct wp_pool pool;
+struct wp_done done;
+int pool_threads;           /* 0 runs everything inline */
+size_t offload_min = OFFLOAD_MIN;
+
+/* A connection; it outlives its bufferevent while a job of it is out */
+struct conn {
+    struct bufferevent *bev;
+    int pending;            /* a job is out, reading is off until it is back */
+    int eof;                /* the peer is done, close once the replies are out */
+    int closed;
+};
+
+struct rot13_job {
+    struct wp_job job;      /* first, jobs come back as struct wp_job */
+    struct conn *conn;
+    size_t n;
+    int newline;            /* one follows data, it was a too long line */
+    char data[];
+};
+
+void readcb(struct bufferevent *bev, void *ctx);
+void errorcb(struct bufferevent *bev, short error, void *ctx);
+
+void
+drainedcb(struct bufferevent *bev, void *ctx)
 {
-    /* We don't want to use isalpha here; setting the locale would change
-     * which characters are considered alphabetical. */
-    if ((c >= 'a' && c <= 'm') || (c >= 'A' && c <= 'M'))
-        return c + 13;
-    else if ((c >= 'n' && c <= 'z') || (c >= 'N' && c <= 'Z'))
-        return c - 13;
+    bufferevent_free(bev);
+    free(ctx);
+}
+
+/* Free conn once its output is written */
+void
+close_when_drained(struct conn *conn)
+{
+    if (evbuffer_get_length(bufferevent_get_output(conn->bev)) == 0)
+        drainedcb(conn->bev, conn);
     else
-        return c;
+        bufferevent_setcb(conn->bev, NULL, drainedcb, errorcb, conn);
+}
+
+void
+rot13_run(struct wp_job *job)
+{
+    struct rot13_job *j = (struct rot13_job *)job;
+    size_t i;
+
+    /* Newlines stay what they are, so whole lines need no splitting */
+    for (i = 0; i < j->n; ++i)
+        j->data[i] = rot13_char(j->data[i]);
+    if (j->newline)
+        j->data[j->n] = '\n';
+}
+
+/* Hand the complete lines in input to the pool, returns 0 if there were none */
+int
+offload(struct conn *conn, struct evbuffer *input)
+{
+    struct rot13_job *j;
+    size_t len = evbuffer_get_length(input), n;
+    unsigned char *p = evbuffer_pullup(input, len);
+    unsigned char *lf = (unsigned char *)memrchr(p, '\n', len);
+    int newline = 0;
+
+    if (lf) {
+        n = lf - p + 1;
+    } else if (len >= MAX_LINE) {
+        n = len;
+        newline = 1;
+    } else {
+        return 0;
+    }
+
+    j = (struct rot13_job *)malloc(sizeof(*j) + n + 1);
+    if (!j)
+        return 0;
+    j->job.run = rot13_run;
+    j->conn = conn;
+    j->n = evbuffer_remove(input, j->data, n);
+    j->newline = newline;
+
+    /* Nothing more from this one until the reply is out, it keeps them in order */
+    conn->pending = 1;
+    bufferevent_disable(conn->bev, EV_READ);
+    wp_submit(&pool, &j->job, &done);
+    return 1;
+}
+
+void
+donecb(evutil_socket_t fd, short events, void *arg)
+{
+    struct wp_job *job, *next;
+    struct rot13_job *j;
+    struct conn *conn;
+    uint64_t n;
+
+    if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    for (job = wp_done_take(&done); job; job = next) {
+        next = job->next;
+        j = (struct rot13_job *)job;
+        conn = j->conn;
+        conn->pending = 0;
+        if (conn->closed) {
+            free(conn);
+        } else {
+            evbuffer_add(bufferevent_get_output(conn->bev), j->data, j->n + j->newline);
+            /* What came in meanwhile would otherwise wait for more */
+            if (!conn->eof)
+                bufferevent_enable(conn->bev, EV_READ);
+            readcb(conn->bev, conn);
+            if (conn->eof && !conn->pending)
+                close_when_drained(conn);
+        }
+        free(j);
+    }
+}
+
+/* Add the rot13 of the n bytes at p to output, then a newline if asked, as one piece */
+void
+add_rot13(struct evbuffer *output, const unsigned char *p, size_t n, int newline)
+{
+    struct evbuffer_iovec v;
+    char *out;
+    size_t i;
+
+    if (evbuffer_reserve_space(output, n + newline, &v, 1) < 1)
+        return;
+    out = (char *)v.iov_base;
+    for (i = 0; i < n; ++i)
+        out[i] = rot13_char(p[i]);
+    if (newline)
+        out[n] = '\n';
+    v.iov_len = n + newline;
+    evbuffer_commit_space(output, &v, 1);
 }
 
 void
 readcb(struct bufferevent *bev, void *ctx)
 {
+    struct conn *conn = (struct conn *)ctx;
     struct evbuffer *input, *output;
-    char *line;
-    size_t n;
-    int i;
+    unsigned char *p, *lf;
+    size_t len;
     input = bufferevent_get_input(bev);
     output = bufferevent_get_output(bev);
 
-    while ((line = evbuffer_readln(input, &n, EVBUFFER_EOL_LF))) {
-        for (i = 0; i < n; ++i)
-            line[i] = rot13_char(line[i]);
-        evbuffer_add(output, line, n);
-        evbuffer_add(output, "\n", 1);
-        free(line);
+    if (conn->pending)
+        return;
+    if (pool_threads && evbuffer_get_length(input) >= offload_min && offload(conn, input))
+        return;
+
+    /* All the complete lines at once, newlines stay what they are, instead
+     * of a line and a newline at a time */
+    len = evbuffer_get_length(input);
+    p = evbuffer_pullup(input, len);
+    lf = (unsigned char *)memrchr(p, '\n', len);
+    if (lf) {
+        add_rot13(output, p, lf - p + 1, 0);
+        evbuffer_drain(input, lf - p + 1);
+        len -= lf - p + 1;
+        p = evbuffer_pullup(input, len);
     }
 
-    if (evbuffer_get_length(input) >= MAX_LINE) {
+    if (len >= MAX_LINE) {
         /* Too long; just process what there is and go on so that the buffer
          * doesn't grow infinitely long. */
-        char buf[1024];
-        while (evbuffer_get_length(input)) {
-            int n = evbuffer_remove(input, buf, sizeof(buf));
-            for (i = 0; i < n; ++i)
-                buf[i] = rot13_char(buf[i]);
-            evbuffer_add(output, buf, n);
-        }
-        evbuffer_add(output, "\n", 1);
+        add_rot13(output, p, len, 1);
+        evbuffer_drain(input, len);
     }
 }
 
 void
 errorcb(struct bufferevent *bev, short error, void *ctx)
 {
+    struct conn *conn = (struct conn *)ctx;
+
     if (error & BEV_EVENT_EOF) {
-        /* connection has been closed, do any clean up here */
-        /* ... */
+        /* connection has been closed; the lines it sent last may still be
+         * in the pool or not written yet */
+        conn->eof = 1;
+        if (!conn->pending)
+            close_when_drained(conn);
+        return;
     } else if (error & BEV_EVENT_ERROR) {
         /* check errno to see what error occurred */
         /* ... */
@@ -80,6 +220,11 @@ errorcb(struct bufferevent *bev, short error, void *ctx)
         /* ... */
     }
     bufferevent_free(bev);
+    /* A job still out frees it when it is back */
+    if (conn->pending)
+        conn->closed = 1;
+    else
+        free(conn);
 }
 
 void
@@ -95,9 +240,15 @@ do_accept(evutil_socket_t listener, short event, void *arg)
         close(fd);
     } else {
         struct bufferevent *bev;
+        struct conn *conn = (struct conn *)calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(fd);
+            return;
+        }
         evutil_make_socket_nonblocking(fd);
         bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_setcb(bev, readcb, NULL, errorcb, NULL);
+        conn->bev = bev;
+        bufferevent_setcb(bev, readcb, NULL, errorcb, conn);
         bufferevent_setwatermark(bev, EV_READ, 0, MAX_LINE);
         bufferevent_enable(bev, EV_READ|EV_WRITE);
     }
@@ -143,14 +294,52 @@ run(void)
     /*XXX check it */
     event_add(listener_event, NULL);
 
+    /* Jobs done by the pool come back on an eventfd */
+    if (pool_threads) {
+        struct event *done_event;
+
+        done.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (done.efd < 0) {
+            perror("eventfd");
+            return;
+        }
+        if (wp_start(&pool, pool_threads) < 0)
+            return;
+        done_event = event_new(base, done.efd, EV_READ|EV_PERSIST, donecb, NULL);
+        event_add(done_event, NULL);
+    }
+
     event_base_dispatch(base);
 }
 
 int
 main(int c, char **v)
 {
+    int opt;
+
     setvbuf(stdout, NULL, _IONBF, 0);
 
+    while ((opt = getopt(c, v, "j:o:")) != -1) {
+        switch (opt) {
+        case 'j':
+            pool_threads = atoi(optarg);
+            if (pool_threads < 0 || pool_threads > WP_MAX_THREADS)
+                goto usage;
+            break;
+        case 'o':
+            if (atoi(optarg) < 1)
+                goto usage;
+            offload_min = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
     run();
     return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-j pool_threads [-o offload_bytes]]\n", v[0]);
+    return 1;
 }
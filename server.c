@@ -11,317 +11,2439 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <linux/net_tstamp.h>
 
 #define CLIENT_QUEUE_LEN   10
 #define SERVER_PORT        5154
 #define BUFFERLENGTH       UINT16_MAX
+#define MAX_WORKERS        64
+#define MAX_ADDRS          16           /* addresses bound for the name */
+#define PEER_SLOTS         4096         /* power of two, 3/4 usable */
+#define PEER_SWEEP_NS      100000000    /* between sweeps of a full map */
+#define DRR_QUANTUM        16384
+#define HEXDUMP_LINE       16
+#define HANDOFF_MAGIC      0x49507636   /* "IPv6" */
+#define HANDOFF_MAX_FDS    64
+#define HANDOFF_TIMEOUT    5
+#define HIST_BUCKETS       64
+#define CAPTURE_MB         64
+#define SOCKBUF_MAX        (4 << 20)    /* udp buffers grow up to this */
+#define SOCKBUF_STEP_NS    100000000ULL /* between changes to a socket's buffers */
+#define SOCKBUF_QUIET_NS   30000000000ULL /* without drops before shrinking back */
+#define OFFLOAD_MIN        16384        /* reads this big go to the pool */
+#define MAX_UNIX           8            /* -u endpoints */
+#define SEQPACKET_CHUNK    65536        /* reply bytes per seqpacket record */
+#define SHM_BATCH          256          /* ring requests per channel and loop iteration */
+#define SHM_RETRY_US       100          /* while a reply ring is full */
+#define COALESCE_RATE      10000        /* requests/s per worker to start coalescing replies */
+#define COALESCE_WINDOW_NS 100000000    /* over which the rate is taken */
+#define DRAIN_SECS         5            /* after SIGTERM, before closing the clients left */
+#define DRAIN_TICK_US      100000       /* select timeout while draining */
+
+#include "addrmap.h"
+#include "capture.h"
+#include "frame.h"
+#include "hexdump.h"
+#include "rot13.h"
+#include "shmring.h"
+#include "sockaddr.h"
+#include "workpool.h"
+
+#define HEXDUMP_BUFFERLENGTH HEXDUMP_LENGTH(BUFFERLENGTH, 16, 8)
+#define FRAME_BUFFERLENGTH (BUFFERLENGTH + FRAME_HEADER_MAX)
+#define FRAME_BATCH        256
+#define COALESCE_BYTES     (4 * HEXDUMP_BUFFERLENGTH) /* of queued replies per worker */
+#define COALESCE_IOV       (2 * FRAME_BATCH)
 
 /*
- *    hexdump - output a hex dump of a hexdump_buffer
+ *    Workers
  *
- *    data is pointer to the buffer
- *    length is length of buffer to convert
- *    linelen is number of chars to output per line
- *    split is number of chars in each chunk on a line
+ *    Each worker runs its own select loop over its own tcp/udp sockets.
+ *    With more than one worker the sockets are bound with SO_REUSEPORT and
+ *    the kernel spreads connections and datagrams over the group. Another
+ *    process of ours could join that group unnoticed, so the port is first
+ *    checked to be free without SO_REUSEPORT. A worker
+ *    may be pinned to a cpu; its buffers are then allocated on that cpu's
+ *    NUMA node. Unix domain listeners cannot be shared that way, each one
+ *    belongs to one worker.
  */
 
-char hexdump_buffer[BUFFERLENGTH / 16 * 71];
-int hexdump(void const *data, size_t length, int linelen, int split) {
-    char *ptr;
-    const char *inptr;
-    int pos;
-    int remaining = length;
-
-    inptr = (char *)data;
-
-    /*
-     *    Assert that the hexdump_buffer is large enough. This should pretty much
-     *    always be the case...
-     *
-     *    hex/ascii gap (2 chars) + closing \0 (1 char)
-     *    split = 4 chars (2 each for hex/ascii) * number of splits
-     *
-     *    (hex = 3 chars, ascii = 1 char) * linelen number of chars
-     */
-    assert(sizeof(hexdump_buffer) >= (3 + (4 * (linelen / split)) + (linelen * 4)));
-    memset(hexdump_buffer, 0, sizeof(hexdump_buffer));
-
-    /*
-     *    Loop through each line remaining
-     */
-    ptr = hexdump_buffer;
-    while (remaining > 0) {
-        int lrem;
-        int splitcount;
-
-        /*
-         *    Loop through the hex chars of this line
-         */
-        lrem = remaining;
-        splitcount = 0;
-        for (pos = 0; pos < linelen; pos++) {
-
-            /* Split hex section if required */
-            if (split == splitcount++) {
-                ptr += sprintf(ptr, "  ");
-                splitcount = 1;
+enum fd_kind {
+    FD_NONE = 0,
+    FD_TCP_LISTEN,
+    FD_UDP,
+    FD_CLIENT,
+    FD_HANDOFF,
+    FD_WAKE,
+    FD_UNIX_LISTEN,
+    FD_SHM_LISTEN,                  /* unix listener for shared memory channels */
+    FD_SHM_CTL,                     /* a channel's connection, it lives as long */
+    FD_SHM,                         /* a channel's request eventfd */
+};
+
+/* Why a shared memory channel has to be looked at without its eventfd */
+enum shm_again {
+    SHM_IDLE,
+    SHM_MORE,                       /* left requests for the next iteration */
+    SHM_FULL,                       /* its reply ring is full */
+};
+
+/* A shared memory channel, see shmring.h */
+struct shm_chan {
+    struct shm_channel *ch;
+    struct shm_layout layout;
+    struct shm_ring req, rep;
+    int ctl;                        /* FD_SHM_CTL connection */
+    int again;                      /* enum shm_again */
+};
+
+/* Token bucket, tokens are bytes */
+struct bucket {
+    double tokens;
+    uint64_t last;                  /* ns of the last refill */
+};
+
+/* Kernel buffers of a udp socket and what did not fit in them */
+struct sockbuf {
+    uint32_t rxq_ovfl;              /* last SO_RXQ_OVFL count seen */
+    int rxq_seen;                   /* rxq_ovfl is valid */
+    uint64_t drops;                 /* datagrams the kernel dropped on receive */
+    uint64_t send_full;             /* sends that found the send buffer full */
+    int rcvbuf, sndbuf;             /* current sizes, as getsockopt() reports them */
+    int rcvbuf_min, sndbuf_min;     /* what the socket started with */
+    uint64_t adjusted_at;           /* ns of the last change */
+    uint64_t dropped_at;            /* ns of the last drop or full send */
+};
+
+/* Per connection state */
+struct conn {
+    struct sockaddr_storage peer;
+    struct addr_key key;            /* of peer, port ignored */
+    struct bucket bucket;
+    int deficit;                    /* deficit round robin credit, bytes */
+    uint64_t resume_at;             /* ns, non-zero while throttled */
+    unsigned char *frames;          /* framed mode input, FRAME_BUFFERLENGTH */
+    int framelen;                   /* bytes of a partial frame in frames */
+    uint64_t tx_at;                 /* realtime ns of the last send, for its tx timestamp */
+    struct sockbuf buf;             /* udp sockets only */
+    int seqpacket;                  /* unix SOCK_SEQPACKET, a read is a whole record */
+    int backlog;                    /* the last read left input for the next iteration */
+    struct shm_chan *chan;          /* FD_SHM_CTL and FD_SHM only */
+};
+
+/* Replies of one connection queued in the worker's iov */
+struct pending {
+    int fd;
+    int iov;                        /* first entry */
+    int iovcnt;
+    uint64_t start;                 /* ns processing started, for the tx timestamp */
+};
+
+/* Rate limit state of one source address, port ignored */
+struct peer {
+    struct bucket bucket;
+};
+
+/* Latency histogram, bucket i counts samples in [2^(i-1), 2^i) ns */
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+enum hist_kind {
+    HIST_QUEUE,                     /* kernel rx timestamp to recvmsg() return */
+    HIST_PROCESS,                   /* recvmsg() return to send */
+    HIST_TX,                        /* send to kernel tx timestamp */
+    HIST_MAX,
+};
+
+enum steering {
+    STEER_NONE,
+    STEER_CBPF,                     /* SO_ATTACH_REUSEPORT_CBPF on the rx cpu */
+    STEER_CPU,                      /* SO_INCOMING_CPU per socket */
+};
+
+struct worker {
+    int id;
+    int cpu;                        /* -1 when not pinned */
+    int node;                       /* NUMA node of the buffers, -1 unknown */
+    int max_fd;
+    int wakefd;                     /* eventfd to interrupt select() */
+    fd_set sock_set;
+    unsigned char kind[FD_SETSIZE]; /* enum fd_kind of each fd in sock_set */
+    char *in;                       /* receive buffer, BUFFERLENGTH */
+    char *out;                      /* hexdump output, COALESCE_BYTES */
+    struct conn *conns;             /* indexed by fd, FD_SETSIZE */
+    struct addr_map peers;          /* addr_key to struct peer, PEER_SLOTS */
+    struct peer overflow;           /* shared by sources beyond the map */
+    uint64_t peers_swept;           /* ns of the last sweep */
+    struct iovec *iov;              /* queued replies, COALESCE_IOV */
+    unsigned char *headers;         /* their frame headers, FRAME_HEADER_MAX each */
+    struct pending *pending;        /* connections with queued replies, COALESCE_IOV */
+    int niov, nheaders, npending;
+    int outlen;                     /* bytes of out queued */
+    int coalescing;                 /* replies wait for the end of the iteration */
+    uint64_t replies;               /* in the current rate window */
+    uint64_t window_at;             /* ns the rate window started */
+    int spare_fd;                   /* given up to refuse a connection when out of fds */
+    int draining;                   /* stopped accepting, see drain_start() */
+    uint64_t drain_at;              /* ns the clients left are closed, 0 until stopping */
+    int throttled;                  /* clients parked by the rate limit */
+    struct histogram hist[HIST_MAX];
+    uint64_t report_at;             /* ns of the next histogram report */
+    struct wp_done done;            /* offloaded jobs back from the pool, on wakefd */
+    int offloaded;                  /* jobs not back yet */
+    int shm_more, shm_full;         /* channels in SHM_MORE and SHM_FULL */
+    pthread_t thread;
+};
+
+struct worker workers[MAX_WORKERS];
+int nworkers = 1;
+int quiesce;                        /* set while handing off, read atomically */
+enum steering steering = STEER_CBPF;
+double rate;                        /* bytes/s per connection and source, 0 off */
+double burst;                       /* bucket depth, bytes */
+int quantum = DRR_QUANTUM;          /* bytes per connection per iteration */
+int busy_poll;                      /* us to spin before blocking, 0 off */
+int framed;                         /* tcp clients speak the framed protocol */
+int timestamping;                   /* seconds between latency reports, 0 off */
+int sockbuf_max = SOCKBUF_MAX;      /* udp buffer limit, bytes, 0 fixed */
+struct wp_pool pool;
+int pool_threads;                   /* 0 runs everything inline */
+int offload_min = OFFLOAD_MIN;      /* bytes */
+int coalesce_rate = COALESCE_RATE;  /* requests/s, 0 always coalesces, -1 never */
+const char *shm_spec;               /* unix endpoint for shared memory channels */
+int drain_secs = DRAIN_SECS;
+int ready_fd = -1;                  /* -R, gets READY=1 once listening */
+int stopping;                       /* SIGTERM or SIGINT came, read atomically */
+struct capture_header *capture;     /* mapped capture file, NULL off */
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void set_busy_poll(int fd);
+void set_timestamping(int fd);
+void udp_init(struct worker *w, int fd);
+
+void worker_add_fd(struct worker *w, int fd, int kind) {
+    if (busy_poll && (kind == FD_TCP_LISTEN || kind == FD_UDP || kind == FD_CLIENT))
+        set_busy_poll(fd);
+    if (timestamping && (kind == FD_UDP || kind == FD_CLIENT))
+        set_timestamping(fd);
+    if (kind == FD_UDP && w->conns != NULL)
+        udp_init(w, fd);
+    FD_SET(fd, &w->sock_set);
+    w->kind[fd] = kind;
+    w->max_fd = (fd > w->max_fd) ? fd : w->max_fd;
+}
+
+/* Close socket used for communication with client */
+void close_client_socket(struct worker *w, int client_sock_fd) {
+    int ret;
+    if (w->kind[client_sock_fd] != FD_CLIENT)
+        return;
+
+    if (w->conns[client_sock_fd].resume_at)
+        w->throttled--;
+    free(w->conns[client_sock_fd].frames);
+    w->conns[client_sock_fd].frames = NULL;
+
+    printf("Closing connection #%d ...\n", client_sock_fd);
+    ret = close(client_sock_fd);
+    if (ret == -1) {
+        perror("close()");
+    }
+    FD_CLR(client_sock_fd, &w->sock_set);
+    w->kind[client_sock_fd] = FD_NONE;
+    w->max_fd = (client_sock_fd == w->max_fd) ? client_sock_fd - 1 : w->max_fd;
+}
+
+/* Parse a cpu list such as 0,2,4-7 into cpus, returns the count */
+int parse_cpulist(const char *list, int *cpus, int max) {
+    int n = 0, first, last;
+    char *end;
+
+    while (*list && n < max) {
+        first = last = strtol(list, &end, 10);
+        if (end == list)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        while (first <= last && n < max)
+            cpus[n++] = first++;
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        list = end;
+    }
+    return n;
+}
+
+/* Pin the calling thread to the worker's cpu and find its NUMA node */
+void worker_pin(struct worker *w) {
+    unsigned int cpu, node;
+    cpu_set_t set;
+    int ret;
+
+    if (w->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0) {
+            fprintf(stderr, "worker %d: pthread_setaffinity_np(%d): %s\n", w->id, w->cpu, strerror(ret));
+            w->cpu = -1;
+        }
+    }
+
+    if (getcpu(&cpu, &node) == 0 && w->cpu >= 0)
+        w->node = node;
+    printf("Worker %d on cpu %d node %d\n", w->id, w->cpu, w->node);
+}
+
+/*
+ *    Allocate memory for a worker. The pages prefer the worker's NUMA node
+ *    and are faulted in from its cpu so first touch places them there too.
+ */
+void *worker_alloc(struct worker *w, size_t len) {
+    unsigned long nodemask;
+    void *p;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (w->node >= 0 && w->node < (int)(8 * sizeof(nodemask))) {
+        nodemask = 1UL << w->node;
+        if (syscall(SYS_mbind, p, len, MPOL_PREFERRED, &nodemask, 8 * sizeof(nodemask) + 1, 0) == -1)
+            perror("mbind()");
+    }
+
+    memset(p, 0, len);
+    return p;
+}
+
+/*
+ *    Steer each connection/datagram to the reuseport socket of the worker
+ *    pinned to the cpu that received it, so the softirq and the worker share
+ *    a cache. Sockets join the group in worker order, so the group index is
+ *    the worker id. CPUs with no worker are spread by number.
+ */
+int attach_steering(int fd) {
+    struct sock_filter code[2 * MAX_WORKERS + 3];
+    struct sock_fprog prog;
+    int n = 0, i;
+
+    code[n++] = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].cpu < 0)
+            continue;
+        code[n++] = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)workers[i].cpu, 0, 1);
+        code[n++] = BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+    }
+    code[n++] = BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)nworkers);
+    code[n++] = BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len = n;
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return -1;
+    }
+    return 0;
+}
+
+/* Apply the steering mode to one of a worker's listening sockets */
+void steer_socket(const struct worker *w, int fd) {
+    if (steering == STEER_CPU && w->cpu >= 0) {
+        if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu)) == -1)
+            perror("setsockopt(SO_INCOMING_CPU)");
+    }
+}
+
+/*
+ *    Whether nobody has the tcp or udp port of addr: a bind without
+ *    SO_REUSEPORT fails if any socket, reuseport or not, holds it.
+ */
+int port_free(const struct sockaddr *addr, socklen_t addrlen) {
+    int types[2] = { SOCK_STREAM, SOCK_DGRAM }, fd, i, ret, flag = 1;
+
+    for (i = 0; i < 2; i++) {
+        fd = socket(addr->sa_family, types[i] | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            perror("socket()");
+            return 0;
+        }
+        if (types[i] == SOCK_STREAM)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        ret = bind(fd, addr, addrlen);
+        close(fd);
+        if (ret == -1) {
+            fprintf(stderr, "%s %s: %s\n", (types[i] == SOCK_STREAM) ? "tcp" : "udp",
+                    sockaddr2nameport(addr), strerror(errno));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Create tcp and udp sockets on addr for w, without adding them to it yet */
+int open_sockets(const struct worker *w, const struct sockaddr *addr, socklen_t addrlen, int *tcpp, int *udpp) {
+    int tcpfd, udpfd, ret, flag, flags;
+
+    /* Create socket for listening (client requests) */
+    tcpfd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (tcpfd == -1) {
+        perror("tcp socket()");
+        return -1;
+    }
+
+    /* Set socket to reuse address, and port between workers */
+    flag = 1;
+    ret = setsockopt(tcpfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (ret == 0 && nworkers > 1)
+        ret = setsockopt(tcpfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+    if (ret == -1) {
+        perror("setsockopt()");
+        close(tcpfd);
+        return -1;
+    }
+
+    /* set non-blocking */
+    flags = fcntl(tcpfd, F_GETFL, 0);
+    ret = fcntl(tcpfd, F_SETFL, flags | O_NONBLOCK);
+    if (ret == -1) {
+        perror("fnctl()");
+        close(tcpfd);
+        return -1;
+    }
+
+    /* Bind address and socket together */
+    ret = bind(tcpfd, addr, addrlen);
+    if (ret == -1) {
+        perror("bind()");
+        close(tcpfd);
+        return -1;
+    }
+
+    /* Create listening queue (client requests) */
+    ret = listen(tcpfd, CLIENT_QUEUE_LEN);
+    if (ret == -1) {
+        perror("listen()");
+        close(tcpfd);
+        return -1;
+    }
+
+    /* Create udp socket for listening (client requests) */
+    udpfd = socket(addr->sa_family, SOCK_DGRAM, 0);
+    if (udpfd == -1) {
+        perror("udp socket()");
+        close(tcpfd);
+        return -1;
+    }
+
+    ret = (nworkers > 1) ? setsockopt(udpfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) : 0;
+    if (ret == -1) {
+        perror("udp setsockopt()");
+        close(tcpfd);
+        close(udpfd);
+        return -1;
+    }
+
+    /* Bind address and socket together */
+    ret = bind(udpfd, addr, addrlen);
+    if (ret == -1) {
+        perror("udp bind()");
+        close(tcpfd);
+        close(udpfd);
+        return -1;
+    }
+
+    steer_socket(w, tcpfd);
+    steer_socket(w, udpfd);
+    *tcpp = tcpfd;
+    *udpp = udpfd;
+    return 0;
+}
+
+/* Create the worker's tcp and udp sockets on addr */
+int open_listeners(struct worker *w, const struct sockaddr *addr, socklen_t addrlen) {
+    int tcpfd, udpfd;
+
+    if (open_sockets(w, addr, addrlen, &tcpfd, &udpfd) == -1)
+        return -1;
+    worker_add_fd(w, tcpfd, FD_TCP_LISTEN);
+    worker_add_fd(w, udpfd, FD_UDP);
+    return 0;
+}
+
+/* A unix socket file nobody accepts on, left by a server that is gone */
+static int unix_stale(const struct sockaddr_un *addr, socklen_t addrlen, int type) {
+    int fd, ret;
+
+    fd = socket(AF_UNIX, type, 0);
+    if (fd == -1)
+        return 0;
+    ret = connect(fd, (const struct sockaddr *)addr, addrlen) == -1 && errno == ECONNREFUSED;
+    close(fd);
+    return ret;
+}
+
+/* Create a unix domain listener of kind on spec (see unix_endpoint()) for w */
+int open_unix_listener(struct worker *w, const char *spec, int kind) {
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int fd, type, ret;
+
+    if (unix_endpoint(spec, &addr, &addrlen, &type) != 1) {
+        fprintf(stderr, "Bad unix endpoint: %s\n", spec);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("unix socket()");
+        return -1;
+    }
+
+    ret = bind(fd, (struct sockaddr *)&addr, addrlen);
+    if (ret == -1 && errno == EADDRINUSE && addr.sun_path[0] != '\0' && unix_stale(&addr, addrlen, type)) {
+        unlink(addr.sun_path);
+        ret = bind(fd, (struct sockaddr *)&addr, addrlen);
+    }
+    if (ret == -1) {
+        perror("unix bind()");
+        close(fd);
+        return -1;
+    }
+
+    ret = listen(fd, CLIENT_QUEUE_LEN);
+    if (ret == -1) {
+        perror("unix listen()");
+        close(fd);
+        return -1;
+    }
+
+    worker_add_fd(w, fd, kind);
+    printf("Listening on %s%s in worker %d\n", spec, (kind == FD_SHM_LISTEN) ? " for shared memory" : "", w->id);
+    return 0;
+}
+
+/* First fd of the given kind owned by w, or -1 */
+int worker_find_fd(struct worker *w, int kind) {
+    int fd;
+
+    for (fd = 0; fd <= w->max_fd; fd++)
+        if (FD_ISSET(fd, &w->sock_set) && w->kind[fd] == kind)
+            return fd;
+    return -1;
+}
+
+/*
+ *    Rate limiting and fairness
+ *
+ *    Every client connection and every source address has a token bucket
+ *    of rate bytes/s. A connection out of tokens is taken out of the select
+ *    set until it can send again, so its data waits in the kernel and tcp
+ *    pushes back on the sender. Datagrams from a source out of tokens are
+ *    dropped before any work is done on them.
+ *
+ *    Deficit round robin caps what a connection gets per loop iteration:
+ *    each ready connection earns quantum bytes, what it does not use carries
+ *    over while it has data pending. Partial reads stay a multiple of the
+ *    hexdump line so the replies add up to the same dump.
+ *
+ *    Source buckets are per worker, keyed by canonical address so a v4
+ *    client counts the same on v4 and v6 sockets. Sources whose bucket has
+ *    refilled are dropped when the map fills up; if that is not enough the
+ *    rest share one bucket.
+ */
+
+void bucket_init(struct bucket *b, uint64_t now) {
+    b->tokens = burst;
+    b->last = now;
+}
+
+void bucket_fill(struct bucket *b, uint64_t now) {
+    b->tokens += (now - b->last) * rate / 1e9;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    b->last = now;
+}
+
+/* A source is worth keeping while its bucket is not full again */
+static int peer_busy(const struct addr_key *key, void *value, void *arg) {
+    struct peer *p = (struct peer *)value;
+
+    (void)key;
+    bucket_fill(&p->bucket, *(uint64_t *)arg);
+    return p->bucket.tokens < burst;
+}
+
+/* The bucket of source address key */
+struct peer *peer_lookup(struct worker *w, const struct addr_key *key, uint64_t now) {
+    struct peer *p;
+    int created;
+
+    p = (struct peer *)addr_map_insert(&w->peers, key, &created);
+    if (p == NULL && now - w->peers_swept >= PEER_SWEEP_NS) {
+        w->peers_swept = now;
+        addr_map_sweep(&w->peers, peer_busy, &now);
+        p = (struct peer *)addr_map_insert(&w->peers, key, &created);
+    }
+    if (p == NULL)
+        return &w->overflow;
+    if (created)
+        bucket_init(&p->bucket, now);
+    return p;
+}
+
+void conn_init(struct worker *w, int fd, const struct sockaddr *peer, socklen_t peerlen, uint64_t now) {
+    struct conn *c = &w->conns[fd];
+
+    memset(c, 0, sizeof(*c));
+    memcpy(&c->peer, peer, peerlen < sizeof(c->peer) ? peerlen : sizeof(c->peer));
+    addr_key_set(&c->key, (struct sockaddr *)&c->peer, 0);
+    bucket_init(&c->bucket, now);
+
+    if (c->peer.ss_family == AF_UNIX) {
+        int type;
+        socklen_t len = sizeof(type);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+            c->seqpacket = (type == SOCK_SEQPACKET);
+    }
+}
+
+/* Park a client until its bucket has refilled */
+void throttle(struct worker *w, int fd, uint64_t until) {
+    printf("Throttling #%d for %lu us\n", fd, (unsigned long)((until - now_ns()) / 1000));
+    FD_CLR(fd, &w->sock_set);
+    w->conns[fd].resume_at = until;
+    w->conns[fd].deficit = 0;
+    w->throttled++;
+}
+
+/* Put back parked clients that are due, returns ns until the next is */
+uint64_t resume_throttled(struct worker *w, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    struct conn *c;
+    int fd;
+
+    for (fd = 0; fd <= w->max_fd; fd++) {
+        c = &w->conns[fd];
+        if (w->kind[fd] != FD_CLIENT || c->resume_at == 0)
+            continue;
+        if (c->resume_at <= now) {
+            FD_SET(fd, &w->sock_set);
+            c->resume_at = 0;
+            w->throttled--;
+        } else if (c->resume_at - now < next)
+            next = c->resume_at - now;
+    }
+    return next;
+}
+
+/*
+ *    How many of the nread pending bytes client fd may process in this loop
+ *    iteration. Returns 0 when the client had to be throttled.
+ */
+int conn_allowance(struct worker *w, int fd, int nread, uint64_t now) {
+    struct conn *c = &w->conns[fd];
+    struct peer *p = NULL;
+    double tokens;
+    int len;
+
+    c->deficit += quantum;
+    len = (nread < c->deficit) ? nread : c->deficit;
+
+    if (rate > 0) {
+        p = peer_lookup(w, &c->key, now);
+        bucket_fill(&c->bucket, now);
+        bucket_fill(&p->bucket, now);
+        tokens = (c->bucket.tokens < p->bucket.tokens) ? c->bucket.tokens : p->bucket.tokens;
+
+        if (tokens < len) {
+            /* Not even a line's worth, wait until there is enough */
+            if (tokens < HEXDUMP_LINE) {
+                double want = (len < burst) ? len : burst;
+                throttle(w, fd, now + (uint64_t)((want - tokens) / rate * 1e9));
+                return 0;
+            }
+            len = (int)tokens;
+        }
+    }
+
+    if (len < nread && len > HEXDUMP_LINE)
+        len -= len % HEXDUMP_LINE;
+
+    if (rate > 0) {
+        c->bucket.tokens -= len;
+        p->bucket.tokens -= len;
+    }
+
+    /* Credit only carries over while the connection has a backlog */
+    c->deficit = (len == nread) ? 0 : c->deficit - len;
+    return len;
+}
+
+/* Charge a datagram to its source, returns 0 if it has to be dropped */
+int datagram_allowed(struct worker *w, const struct sockaddr *sa, int len, uint64_t now) {
+    struct addr_key key;
+    struct peer *p;
+
+    if (rate <= 0)
+        return 1;
+
+    addr_key_set(&key, sa, 0);
+    p = peer_lookup(w, &key, now);
+    bucket_fill(&p->bucket, now);
+    if (p->bucket.tokens < len)
+        return 0;
+    p->bucket.tokens -= len;
+    return 1;
+}
+
+/*
+ *    Busy polling
+ *
+ *    With -P usec the loop spins on a zero timeout select() for up to usec
+ *    before it blocks, so a packet arriving soon after the last one is
+ *    picked up without a wakeup through the scheduler. The sockets also get
+ *    SO_BUSY_POLL so the kernel polls the device queue from recv, and
+ *    SO_PREFER_BUSY_POLL so it may defer interrupts while we poll.
+ */
+
+void set_busy_poll(int fd) {
+    static int warned;
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1 && !warned++)
+        perror("setsockopt(SO_BUSY_POLL)");
+#ifdef SO_PREFER_BUSY_POLL
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == -1 && !warned++)
+        perror("setsockopt(SO_PREFER_BUSY_POLL)");
+#else
+    (void)one;
+#endif
+}
+
+/* Spin until a socket in w is ready or the budget is spent, returns select() */
+int busy_poll_select(struct worker *w, fd_set *work_set) {
+    uint64_t deadline = now_ns() + busy_poll * 1000ULL;
+    struct timeval zero;
+    int ret;
+
+    do {
+        memcpy(work_set, &w->sock_set, sizeof(fd_set));
+        zero.tv_sec = 0;
+        zero.tv_usec = 0;
+        ret = select(w->max_fd + 1, work_set, NULL, NULL, &zero);
+    } while (ret == 0 && now_ns() < deadline);
+    return ret;
+}
+
+/*
+ *    Udp socket buffers
+ *
+ *    A datagram that arrives while the receive buffer is full is dropped by
+ *    the kernel, typically while the loop is busy dumping a large tcp read.
+ *    SO_RXQ_OVFL makes every read carry the socket's drop count, so drops
+ *    are counted as they happen. On drops the receive buffer doubles, at
+ *    most every SOCKBUF_STEP_NS and up to -U bytes, and a send that finds
+ *    its buffer full grows the send buffer the same way. After
+ *    SOCKBUF_QUIET_NS without either they halve back towards where they
+ *    started. SO_RCVBUFFORCE/SO_SNDBUFFORCE go past net.core.rmem_max and
+ *    wmem_max when we have CAP_NET_ADMIN.
+ */
+
+int sockbuf_get(int fd, int opt) {
+    int size = 0;
+    socklen_t len = sizeof(size);
+
+    if (getsockopt(fd, SOL_SOCKET, opt, &size, &len) == -1)
+        perror("getsockopt()");
+    return size;
+}
+
+/* Resize to about want bytes as getsockopt() counts them, returns the new size */
+int sockbuf_set(int fd, int opt, int force_opt, int want) {
+    int half = want / 2;            /* the kernel doubles what it is given */
+
+    if (setsockopt(fd, SOL_SOCKET, force_opt, &half, sizeof(half)) == -1 &&
+            setsockopt(fd, SOL_SOCKET, opt, &half, sizeof(half)) == -1)
+        perror("setsockopt()");
+    return sockbuf_get(fd, opt);
+}
+
+void udp_init(struct worker *w, int fd) {
+    struct sockbuf *b = &w->conns[fd].buf;
+    int one = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) == -1)
+        perror("setsockopt(SO_RXQ_OVFL)");
+    memset(b, 0, sizeof(*b));
+    b->rcvbuf = b->rcvbuf_min = sockbuf_get(fd, SO_RCVBUF);
+    b->sndbuf = b->sndbuf_min = sockbuf_get(fd, SO_SNDBUF);
+}
+
+/* Grow one buffer of fd after a drop, if it may */
+static void sockbuf_grow(struct worker *w, int fd, int *size, int opt, int force_opt,
+                         const char *name, uint64_t now) {
+    struct sockbuf *b = &w->conns[fd].buf;
+    int want;
+
+    b->dropped_at = now;
+    if (*size >= sockbuf_max || now - b->adjusted_at < SOCKBUF_STEP_NS)
+        return;
+    want = (*size > sockbuf_max / 2) ? sockbuf_max : *size * 2;
+    b->adjusted_at = now;
+    printf("Worker %d udp #%d: %s %d -> ", w->id, fd, name, *size);
+    *size = sockbuf_set(fd, opt, force_opt, want);
+    printf("%d\n", *size);
+}
+
+/*
+ *    Account for a datagram read from fd. ovfl is the SO_RXQ_OVFL count it
+ *    came with, if have_ovfl; the kernel leaves it out until the first drop.
+ */
+void udp_account(struct worker *w, int fd, int have_ovfl, uint32_t ovfl, uint64_t now) {
+    struct sockbuf *b = &w->conns[fd].buf;
+    uint32_t delta;
+
+    if (have_ovfl) {
+        delta = b->rxq_seen ? ovfl - b->rxq_ovfl : ovfl;
+        b->rxq_ovfl = ovfl;
+        b->rxq_seen = 1;
+        if (delta > 0) {
+            b->drops += delta;
+            printf("Worker %d udp #%d: kernel dropped %u datagrams, %llu in all\n",
+                   w->id, fd, delta, (unsigned long long)b->drops);
+            sockbuf_grow(w, fd, &b->rcvbuf, SO_RCVBUF, SO_RCVBUFFORCE, "rcvbuf", now);
+            return;
+        }
+    }
+
+    /* Quiet for a while, give memory back */
+    if (now - b->dropped_at >= SOCKBUF_QUIET_NS && now - b->adjusted_at >= SOCKBUF_QUIET_NS &&
+            (b->rcvbuf > b->rcvbuf_min || b->sndbuf > b->sndbuf_min)) {
+        b->adjusted_at = now;
+        if (b->rcvbuf > b->rcvbuf_min)
+            b->rcvbuf = sockbuf_set(fd, SO_RCVBUF, SO_RCVBUFFORCE,
+                                    (b->rcvbuf / 2 > b->rcvbuf_min) ? b->rcvbuf / 2 : b->rcvbuf_min);
+        if (b->sndbuf > b->sndbuf_min)
+            b->sndbuf = sockbuf_set(fd, SO_SNDBUF, SO_SNDBUFFORCE,
+                                    (b->sndbuf / 2 > b->sndbuf_min) ? b->sndbuf / 2 : b->sndbuf_min);
+        printf("Worker %d udp #%d: quiet, rcvbuf %d sndbuf %d\n", w->id, fd, b->rcvbuf, b->sndbuf);
+    }
+}
+
+/* A send on udp fd found the send buffer full */
+void udp_send_full(struct worker *w, int fd, uint64_t now) {
+    struct sockbuf *b = &w->conns[fd].buf;
+
+    b->send_full++;
+    sockbuf_grow(w, fd, &b->sndbuf, SO_SNDBUF, SO_SNDBUFFORCE, "sndbuf", now);
+}
+
+/*
+ *    Timestamping
+ *
+ *    With -T secs the udp and tcp client sockets get SO_TIMESTAMPING. Every
+ *    read then carries the software time the kernel received the packet, and
+ *    every send is answered on the error queue with the time it left for the
+ *    device. Each worker feeds three histograms: the time a request waited
+ *    in the kernel and in our select loop, the time we spent on it, and the
+ *    time its reply took through the kernel. They are printed every secs
+ *    seconds. Kernels without tx timestamps get the first two.
+ */
+
+uint64_t realtime_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void set_timestamping(int fd) {
+    static int warned;
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+        return;
+    flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1 && !warned++)
+        perror("setsockopt(SO_TIMESTAMPING)");
+}
+
+/* The software timestamp in the control messages of mh, 0 if none */
+uint64_t cmsg_timestamp(struct msghdr *mh) {
+    struct cmsghdr *cm;
+    struct scm_timestamping *ts;
+
+    for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        ts = (struct scm_timestamping *)CMSG_DATA(cm);
+        return (uint64_t)ts->ts[0].tv_sec * 1000000000ULL + ts->ts[0].tv_nsec;
+    }
+    return 0;
+}
+
+void hist_add(struct histogram *h, uint64_t ns) {
+    int i = ns ? 64 - __builtin_clzll(ns) : 0;
+
+    h->bucket[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+    h->count++;
+    h->max = (ns > h->max) ? ns : h->max;
+}
+
+/* Upper bound of the bucket holding percentile p, in microseconds, at most max */
+double hist_percentile(struct histogram *h, double p) {
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > rank)
+            break;
+    }
+    if (i == HIST_BUCKETS || (1ULL << i) > h->max)
+        return h->max / 1000.0;
+    return (1ULL << i) / 1000.0;
+}
+
+/* Print and reset the histograms of w */
+void hist_report(struct worker *w) {
+    static const char *name[HIST_MAX] = { "queue", "process", "tx" };
+    struct histogram *h;
+    int i;
+
+    for (i = 0; i < HIST_MAX; i++) {
+        h = &w->hist[i];
+        if (h->count == 0)
+            continue;
+        printf("Worker %d %-7s n=%llu p50<%.1fus p90<%.1fus p99<%.1fus max=%.1fus\n",
+               w->id, name[i], (unsigned long long)h->count,
+               hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99),
+               h->max / 1000.0);
+    }
+    memset(w->hist, 0, sizeof(w->hist));
+
+    for (i = 0; i <= w->max_fd; i++) {
+        struct sockbuf *b = &w->conns[i].buf;
+
+        if (w->kind[i] != FD_UDP)
+            continue;
+        printf("Worker %d udp #%d drops=%llu send_full=%llu rcvbuf=%d sndbuf=%d\n",
+               w->id, i, (unsigned long long)b->drops, (unsigned long long)b->send_full,
+               b->rcvbuf, b->sndbuf);
+    }
+}
+
+/*
+ *    recvfrom() through recvmsg() for the control messages: records the
+ *    queueing delay of what it read and, on udp sockets, kernel drops. The
+ *    clock reading at return is left in *done, monotonic, to time the
+ *    processing. A seqpacket record longer than len fails with EMSGSIZE
+ *    rather than being cut short.
+ */
+ssize_t recv_packet(struct worker *w, int fd, void *buf, size_t len, int flags,
+                    struct sockaddr *addr, socklen_t *addrlen, uint64_t *done) {
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct iovec iov = { buf, len };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    uint32_t ovfl = 0;
+    int have_ovfl = 0;
+    uint64_t rx;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = addr;
+    mh.msg_namelen = addrlen ? *addrlen : 0;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    ret = recvmsg(fd, &mh, flags);
+    *done = now_ns();
+    if (ret == -1)
+        return ret;
+    if (addrlen)
+        *addrlen = mh.msg_namelen;
+    if ((mh.msg_flags & MSG_TRUNC) && w->kind[fd] == FD_CLIENT && w->conns[fd].seqpacket) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (timestamping && (rx = cmsg_timestamp(&mh)) != 0) {
+        uint64_t now = realtime_ns();
+        hist_add(&w->hist[HIST_QUEUE], now > rx ? now - rx : 0);
+    }
+
+    if (w->kind[fd] == FD_UDP) {
+        for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+                memcpy(&ovfl, CMSG_DATA(cm), sizeof(ovfl));
+                have_ovfl = 1;
+            }
+        }
+        udp_account(w, fd, have_ovfl, ovfl, *done);
+    }
+    return ret;
+}
+
+/* Note a send on fd about to happen, started processing at start */
+void tx_start(struct worker *w, int fd, uint64_t start) {
+    if (!timestamping)
+        return;
+    hist_add(&w->hist[HIST_PROCESS], now_ns() - start);
+    w->conns[fd].tx_at = realtime_ns();
+}
+
+/*
+ *    Read the tx timestamps queued on fd. Returns how many there were, a
+ *    socket may be readable for these alone.
+ */
+int drain_tx_timestamps(struct worker *w, int fd) {
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+                 CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr mh;
+    uint64_t tx;
+    int n = 0;
+
+    while (1) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+        n++;
+        tx = cmsg_timestamp(&mh);
+        if (tx && w->conns[fd].tx_at && tx > w->conns[fd].tx_at)
+            hist_add(&w->hist[HIST_TX], tx - w->conns[fd].tx_at);
+    }
+    return n;
+}
+
+/*
+ *    Capture
+ *
+ *    With -C file every read is appended to a ring in file (see capture.h)
+ *    with its peer and the time, for bench/replay to send again later. The
+ *    file is mapped shared, so records reach it without a write() and
+ *    survive a crash. A server restarted on the same file carries on after
+ *    the last record. Workers share the ring under a mutex.
+ */
+
+int capture_open(const char *path, uint64_t size) {
+    struct capture_header *h;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open()");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (st.st_size != (off_t)(CAPTURE_DATA + size) &&
+                                 ftruncate(fd, CAPTURE_DATA + size) == -1)) {
+        perror("ftruncate()");
+        close(fd);
+        return -1;
+    }
+
+    h = (struct capture_header *)mmap(NULL, CAPTURE_DATA + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        perror("mmap()");
+        return -1;
+    }
+
+    /* Start over unless this is a ring of the same size */
+    if (h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION || h->size != size) {
+        memset(h, 0, sizeof(*h));
+        h->magic = CAPTURE_MAGIC;
+        h->version = CAPTURE_VERSION;
+        h->size = size;
+    }
+    printf("Capturing to %s, %llu records\n", path, (unsigned long long)h->records);
+    capture = h;
+    return 0;
+}
+
+/* Drop the oldest records until len more bytes fit, capture_lock held */
+static void capture_make_room(uint64_t len) {
+    while (capture->head + len - capture->tail > capture->size) {
+        struct capture_record *r = capture_at(capture, capture->tail);
+
+        if (!capture_is_pad(r))
+            capture->dropped++;
+        capture->tail += r->length;
+    }
+}
+
+void capture_packet(int proto, int conn, const struct sockaddr *sa, const void *data, size_t len) {
+    struct capture_record *r;
+    uint64_t length = CAPTURE_RECORD_LENGTH(len), pad;
+
+    if (length > capture->size)
+        return;
+
+    pthread_mutex_lock(&capture_lock);
+
+    /* Records do not wrap, pad out the end of the ring instead */
+    pad = capture->size - capture->head % capture->size;
+    if (pad < length) {
+        capture_make_room(pad);
+        r = capture_at(capture, capture->head);
+        r->length = pad;
+        if (pad >= sizeof(*r))
+            r->proto = CAPTURE_PAD;
+        capture->head += pad;
+    }
+
+    capture_make_room(length);
+    r = capture_at(capture, capture->head);
+    memset(r, 0, sizeof(*r));
+    r->length = length;
+    r->caplen = len;
+    r->ts = realtime_ns();
+    r->conn = conn;
+    r->proto = proto;
+    if (sa != NULL && sa->sa_family == AF_INET) {
+        r->family = AF_INET;
+        r->port = ((struct sockaddr_in *)sa)->sin_port;
+        memcpy(r->addr, &((struct sockaddr_in *)sa)->sin_addr, 4);
+    } else if (sa != NULL && sa->sa_family == AF_INET6) {
+        r->family = AF_INET6;
+        r->port = ((struct sockaddr_in6 *)sa)->sin6_port;
+        memcpy(r->addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+    }
+    memcpy(r + 1, data, len);
+
+    __atomic_store_n(&capture->head, capture->head + length, __ATOMIC_RELEASE);
+    capture->records++;
+
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ *    Reply coalescing
+ *
+ *    Replies on stream connections are queued in the worker's out buffer
+ *    and iov array, and each connection's queue goes out with one
+ *    sendmsg(). A worker answering fewer than -K requests a second flushes
+ *    a reply as soon as it is queued, so nothing waits. Above that rate it
+ *    puts throughput first: replies wait for the end of the loop iteration,
+ *    or until the buffer is full. The rate is taken over
+ *    COALESCE_WINDOW_NS, and a coalescing worker stops only below half of
+ *    -K, so a worker near the line does not flap.
+ *
+ *    Either way, a tcp connection whose read left input for the next
+ *    iteration is sent with MSG_MORE: the kernel keeps back a short last
+ *    segment until the answer to the rest joins it, rather than leaving it
+ *    to Nagle to hold until the client's delayed ack. Udp and seqpacket
+ *    replies are never queued, each is a message of its own.
+ */
+
+/*
+ *    Wait for client fd to take more of a reply. A client that stops
+ *    reading holds the worker here, so once the server is stopping the
+ *    wait ends at the drain deadline, counted from when this worker first
+ *    saw the signal. Returns -1 with ETIMEDOUT when it has passed.
+ */
+int send_wait(struct worker *w, int fd) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    uint64_t now = now_ns();
+    int timeout = DRAIN_TICK_US / 1000, ret;
+
+    if (w->drain_at == 0 && __atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+        w->drain_at = now + drain_secs * 1000000000ULL;
+    if (w->drain_at != 0) {
+        if (now >= w->drain_at) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (w->drain_at - now < DRAIN_TICK_US * 1000ULL)
+            timeout = (w->drain_at - now) / 1000000 + 1;
+    }
+
+    /* Woken up every tick to notice a signal, the caller just tries again */
+    ret = poll(&pfd, 1, timeout);
+    return (ret == -1 && errno != EINTR) ? -1 : 0;
+}
+
+/* Write all of iov on client fd, returns -1 if the connection failed */
+int send_batch(struct worker *w, int fd, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ret = sendmsg(fd, &msg, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret == -1) {
+            if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && send_wait(w, fd) == 0))
+                continue;
+            perror("sendmsg()");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+/* Replies on fd are queued rather than sent right away */
+int reply_queues(struct worker *w, int fd) {
+    return w->kind[fd] == FD_CLIENT && !w->conns[fd].seqpacket;
+}
+
+/*
+ *    Send everything queued. A connection that fails is closed, except
+ *    busy, the one the caller is still working on; returns -1 if that one
+ *    failed.
+ */
+int reply_flush(struct worker *w, int busy) {
+    struct pending *p;
+    struct conn *c;
+    int i, flags, ret = 0;
+
+    for (i = 0; i < w->npending; i++) {
+        p = &w->pending[i];
+        c = &w->conns[p->fd];
+        if (w->kind[p->fd] != FD_CLIENT)
+            continue;
+        flags = (c->backlog && c->peer.ss_family != AF_UNIX) ? MSG_MORE : 0;
+        tx_start(w, p->fd, p->start);
+        if (send_batch(w, p->fd, w->iov + p->iov, p->iovcnt, flags) == -1) {
+            if (p->fd == busy)
+                ret = -1;
+            else
+                close_client_socket(w, p->fd);
+        }
+    }
+    w->npending = w->niov = w->nheaders = w->outlen = 0;
+    return ret;
+}
+
+/*
+ *    Make room for a reply of up to len bytes at w->out + w->outlen, in
+ *    iovs entries, flushing the queue when it would not fit. Returns -1 if
+ *    fd failed in that flush.
+ */
+int reply_room(struct worker *w, int fd, int len, int iovs) {
+    if (COALESCE_BYTES - w->outlen >= len && COALESCE_IOV - w->niov >= iovs)
+        return 0;
+    return reply_flush(w, fd);
+}
+
+/* Queue the len bytes at base, in out or headers, as the next part of fd's replies */
+void reply_add(struct worker *w, int fd, void *base, int len, uint64_t start) {
+    struct pending *p;
+
+    if (w->npending == 0 || w->pending[w->npending - 1].fd != fd) {
+        p = &w->pending[w->npending++];
+        p->fd = fd;
+        p->iov = w->niov;
+        p->iovcnt = 0;
+        p->start = start;
+    } else
+        p = &w->pending[w->npending - 1];
+    w->iov[w->niov].iov_base = base;
+    w->iov[w->niov++].iov_len = len;
+    p->iovcnt++;
+}
+
+/* Pick latency or throughput first from the rate of the last window */
+void reply_adapt(struct worker *w, uint64_t now) {
+    double rps;
+    int on;
+
+    if (now - w->window_at < COALESCE_WINDOW_NS)
+        return;
+    rps = w->replies * 1e9 / (now - w->window_at);
+    if (coalesce_rate <= 0)
+        on = (coalesce_rate == 0);
+    else
+        on = rps >= (w->coalescing ? coalesce_rate / 2 : coalesce_rate);
+    if (on != w->coalescing)
+        printf("Worker %d %s coalescing replies at %.0f requests/s\n", w->id, on ? "starts" : "stops", rps);
+    w->coalescing = on;
+    w->replies = 0;
+    w->window_at = now;
+}
+
+/*
+ *    Framed protocol
+ *
+ *    With -F a tcp client sends frames, see frame.h, and may pipeline as
+ *    many as it likes. Each read appends to the connection's buffer; every
+ *    complete frame in it is answered with a frame carrying the same id
+ *    and the hexdump of the payload. The replies to a read are queued
+ *    together, header and dump each an iov entry, and go out with one
+ *    sendmsg() instead of a send per request. A partial frame stays
+ *    buffered until the rest arrives.
+ */
+
+/* Read up to nread bytes from client fd and answer the complete frames */
+int serve_frames(struct worker *w, int fd, int nread) {
+    struct conn *c = &w->conns[fd];
+    uint64_t length, id, start;
+    int ret, pos = 0, nframes = 0, hdrlen, nwrite;
+    unsigned char *hdr;
+
+    if (c->frames == NULL) {
+        c->frames = (unsigned char *)malloc(FRAME_BUFFERLENGTH);
+        if (c->frames == NULL) {
+            perror("malloc()");
+            return -1;
+        }
+    }
+
+    if (nread > FRAME_BUFFERLENGTH - c->framelen)
+        nread = FRAME_BUFFERLENGTH - c->framelen;
+    ret = recv_packet(w, fd, c->frames + c->framelen, nread, MSG_DONTWAIT, NULL, NULL, &start);
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        perror("recvmsg()");
+        return -1;
+    }
+    if (capture)
+        capture_packet(CAPTURE_TCP, fd, (struct sockaddr *)&c->peer, c->frames + c->framelen, ret);
+    c->framelen += ret;
+
+    while (1) {
+        hdrlen = frame_header_decode(c->frames + pos, c->framelen - pos, &length, &id);
+        if (hdrlen == -1 || (hdrlen > 0 && length > BUFFERLENGTH)) {
+            fprintf(stderr, "Bad frame from #%d\n", fd);
+            return -1;
+        }
+        if (hdrlen == 0 || c->framelen - pos - hdrlen < (int)length)
+            break;
+
+        if (reply_room(w, fd, HEXDUMP_LENGTH(length, 16, 8), 2) == -1)
+            return -1;
+        nwrite = hexdump(w->out + w->outlen, c->frames + pos + hdrlen, length, 16, 8);
+        hdr = w->headers + w->nheaders++ * FRAME_HEADER_MAX;
+        reply_add(w, fd, hdr, frame_header_encode(nwrite, id, hdr), start);
+        reply_add(w, fd, w->out + w->outlen, nwrite, start);
+        w->outlen += nwrite;
+        pos += hdrlen + length;
+        nframes++;
+    }
+
+    w->replies += nframes;
+    if (!w->coalescing && reply_flush(w, fd) == -1)
+        return -1;
+
+    /* Keep the partial frame for the next read */
+    c->framelen -= pos;
+    if (pos > 0 && c->framelen > 0)
+        memmove(c->frames, c->frames + pos, c->framelen);
+
+    printf("Received %i bytes from #%d, answered %d frames\n", ret, fd, nframes);
+    return 0;
+}
+
+/*
+ *    Send a reply on fd; a full udp send buffer is grown and waited for.
+ *    A client gone before its reply is out fails with EPIPE, not SIGPIPE.
+ */
+int send_reply(struct worker *w, int fd, const char *buf, int len,
+               const struct sockaddr *addr, socklen_t addrlen, uint64_t now) {
+    int ret, off, n;
+
+    /* A record has to fit the socket's send buffer, long replies take several */
+    if (w->kind[fd] == FD_CLIENT && w->conns[fd].seqpacket) {
+        for (off = 0; off < len; off += n) {
+            n = (len - off < SEQPACKET_CHUNK) ? len - off : SEQPACKET_CHUNK;
+            while ((ret = send(fd, buf + off, n, MSG_NOSIGNAL | MSG_DONTWAIT)) != n) {
+                if (ret == -1 && (errno == EINTR ||
+                                  ((errno == EAGAIN || errno == EWOULDBLOCK) && send_wait(w, fd) == 0)))
+                    continue;
+                perror("seqpacket send()");
+                return -1;
             }
+        }
+        return len;
+    }
+
+    /* A connected socket takes no address, a bound unix client would fail with EISCONN */
+    if (w->kind[fd] == FD_CLIENT) {
+        struct iovec iov = { (void *)buf, (size_t)len };
+
+        return (send_batch(w, fd, &iov, 1, 0) == -1) ? -1 : len;
+    }
+
+    ret = sendto(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT, addr, addrlen);
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        udp_send_full(w, fd, now);
+        ret = sendto(fd, buf, len, MSG_NOSIGNAL, addr, addrlen);
+    }
+    if (ret == -1)
+        perror("sendto()");
+    return ret;
+}
+
+/*
+ *    Offloading
+ *
+ *    With -j threads a read of at least -o bytes is dumped by the work
+ *    stealing pool in workpool.h instead of in the loop, so one 64K request
+ *    does not hold up every other client of the worker. The client is left
+ *    out of select until its reply is sent, which keeps its replies in
+ *    order. Finished jobs come back on the worker's wakefd. Smaller reads
+ *    stay inline, the round trip through the pool would cost more than the
+ *    dump.
+ */
+
+struct offload {
+    struct wp_job job;              /* first, jobs come back as struct wp_job */
+    int fd;
+    struct sockaddr_in6 addr;
+    socklen_t addrlen;
+    int nread, nwrite;
+    char *in, *out;                 /* in the same allocation */
+};
+
+static void offload_run(struct wp_job *job) {
+    struct offload *o = (struct offload *)job;
+
+    o->nwrite = hexdump(o->out, o->in, o->nread, 16, 8);
+}
+
+/* Dump the nread bytes in w->in from fd in the pool, returns -1 if it has to be done here */
+int offload(struct worker *w, int fd, const struct sockaddr *addr, socklen_t addrlen, int nread) {
+    struct offload *o;
+
+    o = (struct offload *)malloc(sizeof(*o) + nread + HEXDUMP_LENGTH(nread, 16, 8));
+    if (o == NULL)
+        return -1;
+    o->job.run = offload_run;
+    o->fd = fd;
+    o->addrlen = (addrlen < sizeof(o->addr)) ? addrlen : sizeof(o->addr);
+    memcpy(&o->addr, addr, o->addrlen);
+    o->nread = nread;
+    o->in = (char *)(o + 1);
+    o->out = o->in + nread;
+    memcpy(o->in, w->in, nread);
+
+    if (w->kind[fd] == FD_CLIENT)
+        FD_CLR(fd, &w->sock_set);
+    w->offloaded++;
+    wp_submit(&pool, &o->job, &w->done);
+    return 0;
+}
+
+/* Send the replies of the jobs that came back */
+void offload_complete(struct worker *w) {
+    struct wp_job *job, *next;
+    struct offload *o;
+
+    for (job = wp_done_take(&w->done); job != NULL; job = next) {
+        next = job->next;
+        o = (struct offload *)job;
+        w->offloaded--;
+        w->replies++;
+
+        printf("Sending %i bytes to #%d (offloaded)\n", o->nwrite, o->fd);
+        if (send_reply(w, o->fd, o->out, o->nwrite, (struct sockaddr *)&o->addr, o->addrlen, now_ns()) == -1)
+            close_client_socket(w, o->fd);
+        else if (w->kind[o->fd] == FD_CLIENT)
+            FD_SET(o->fd, &w->sock_set);
+        free(o);
+    }
+}
+
+/* Wait for every job of w, for a worker that is not looping */
+void offload_drain(struct worker *w) {
+    struct pollfd pfd;
+    uint64_t n;
+
+    pfd.fd = w->wakefd;
+    pfd.events = POLLIN;
+    while (w->offloaded > 0) {
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll()");
+            return;
+        }
+        if (read(w->wakefd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+            perror("eventfd read()");
+        offload_complete(w);
+    }
+}
+
+/*
+ *    Shared memory channels
+ *
+ *    With -m endpoint, local clients can skip sockets altogether. A client
+ *    connects to the unix endpoint and passes a sealed memfd holding a
+ *    request and a reply ring, plus an eventfd for each (shmring.h). The
+ *    request eventfd joins the worker's select set; requests are dumped,
+ *    echoed or rot13'd, as the channel asks, straight from one ring into
+ *    the other. The channel is gone when its connection closes. A channel
+ *    with requests left over, or no room for a reply, is looked at again
+ *    on the next iteration, since its eventfd only fires when the request
+ *    ring goes from empty to not.
+ */
+
+void shm_set_again(struct worker *w, struct shm_chan *c, int again) {
+    w->shm_more += (again == SHM_MORE) - (c->again == SHM_MORE);
+    w->shm_full += (again == SHM_FULL) - (c->again == SHM_FULL);
+    c->again = again;
+}
+
+void shm_close(struct worker *w, struct shm_chan *c) {
+    int fds[2] = { c->ctl, c->req.efd }, i;
+
+    printf("Closing shared memory channel #%d ...\n", c->ctl);
+    shm_set_again(w, c, SHM_IDLE);
+    for (i = 0; i < 2; i++) {
+        if (fds[i] == -1)
+            continue;
+        FD_CLR(fds[i], &w->sock_set);
+        w->kind[fds[i]] = FD_NONE;
+        w->conns[fds[i]].chan = NULL;
+        close(fds[i]);
+    }
+    while (w->max_fd >= 0 && w->kind[w->max_fd] == FD_NONE)
+        w->max_fd--;
+    if (c->rep.efd != -1)
+        close(c->rep.efd);
+    if (c->ch != NULL)
+        munmap(c->ch, c->layout.length);
+    free(c);
+}
+
+/* Set up the channel a client passes on its connection ctl */
+int shm_accept(struct worker *w, int ctl) {
+    char control[CMSG_SPACE(3 * sizeof(int))], byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct shm_chan *c;
+    int fds[3] = { -1, -1, -1 }, nfds = 0, i;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (recvmsg(ctl, &mh, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != 1)
+        return -1;
+    for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), sizeof(int) * (nfds < 3 ? nfds : 3));
+        }
+    }
+
+    c = (struct shm_chan *)calloc(1, sizeof(*c));
+    if (nfds != 3 || c == NULL || fds[1] >= FD_SETSIZE ||
+            (c->ch = shm_channel_map(fds[0], &c->layout)) == NULL) {
+        fprintf(stderr, "shm: bad channel from #%d\n", ctl);
+        for (i = 0; i < 3; i++)
+            if (fds[i] != -1)
+                close(fds[i]);
+        free(c);
+        return -1;
+    }
+    close(fds[0]);
+
+    shm_channel_rings(c->ch, &c->layout, &c->req, fds[1], &c->rep, fds[2]);
+    c->ctl = ctl;
+    w->conns[ctl].chan = c;
+    w->conns[fds[1]].chan = c;
+    worker_add_fd(w, fds[1], FD_SHM);
+
+    printf("Shared memory channel #%d: mode %d, %lu byte requests, %lu byte replies\n", ctl,
+           c->layout.mode, (unsigned long)c->layout.req_size, (unsigned long)c->layout.rep_size);
+    if (send(ctl, "A", 1, MSG_NOSIGNAL) != 1) {
+        perror("shm ack");
+        return -1;
+    }
+    return 0;
+}
+
+/* Answer up to SHM_BATCH requests of c, returns -1 if the client broke the ring */
+int serve_shm(struct worker *w, struct shm_chan *c) {
+    unsigned char *in;
+    char *out;
+    uint32_t len, nwrite, i;
+    uint64_t max;
+    int n;
+
+    for (n = 0; n < SHM_BATCH; n++) {
+        in = (unsigned char *)shm_ring_peek(&c->req, &len);
+        if (in == NULL) {
+            shm_set_again(w, c, SHM_IDLE);
+            return 0;
+        }
+        if (in == (void *)-1)
+            return -1;
+
+        printf("Received %u bytes from channel #%d\n", len, c->ctl);
+        /* The client picks len and the ring sizes, the dump of len may not even fit 32 bits */
+        max = (c->layout.mode == SHM_HEXDUMP) ? HEXDUMP_LENGTH((uint64_t)len, 16, 8) : len;
+        if (max > INT32_MAX || SHM_RECORD_LENGTH(max) > c->rep.size / 2) {
+            fprintf(stderr, "shm: reply of %llu bytes does not fit the ring\n", (unsigned long long)max);
+            return -1;
+        }
+        out = (char *)shm_ring_reserve(&c->rep, max);
+        if (out == NULL) {
+            shm_set_again(w, c, SHM_FULL);
+            return 0;
+        }
+        if (out == (void *)-1)
+            return -1;
+
+        switch (c->layout.mode) {
+        case SHM_HEXDUMP:
+            nwrite = hexdump(out, in, len, 16, 8);
+            break;
+        case SHM_ROT13:
+            for (i = 0; i < len; i++)
+                out[i] = rot13_char(in[i]);
+            nwrite = len;
+            break;
+        default:
+            memcpy(out, in, len);
+            nwrite = len;
+        }
+        printf("Sending %u bytes to channel #%d\n", nwrite, c->ctl);
+        shm_ring_publish(&c->rep, nwrite);
+        shm_ring_release(&c->req, len);
+    }
+    shm_set_again(w, c, SHM_MORE);
+    return 0;
+}
+
+/* Go over the channels that cannot wait for their eventfd */
+void shm_retry(struct worker *w) {
+    int fd;
+
+    for (fd = 0; fd <= w->max_fd; fd++)
+        if (w->kind[fd] == FD_SHM && w->conns[fd].chan->again != SHM_IDLE &&
+                serve_shm(w, w->conns[fd].chan) == -1)
+            shm_close(w, w->conns[fd].chan);
+}
+
+/*
+ *    Hot restart
+ *
+ *    A running server started with -H path listens on a SOCK_SEQPACKET unix
+ *    socket at path. A new server started with the same -H path connects to
+ *    it before doing any getaddrinfo/bind work. The old server sends every
+ *    listening and established socket over with SCM_RIGHTS, waits for an
+ *    ack and exits. The kernel sockets never close, so connected clients see
+ *    no reset and datagrams that arrive meanwhile wait in the udp socket.
+ *    A partial request buffered in framed mode follows its fd.
+ *    If the new server dies before it acks, the old one keeps serving.
+ *    Listeners and udp sockets carry the index of their address, and go
+ *    in worker order, so the new server rebuilds each reuseport group in
+ *    the order the steering program expects.
+ */
 
-            /* If remaining chars, output, else leave a space */
-            if (lrem) {
-                ptr += sprintf(ptr, "%.2x ", *((unsigned char *) inptr + pos));
-                lrem--;
-            } else
-                ptr += sprintf(ptr, "   ");
-        }
+struct handoff_msg {
+    uint32_t magic;
+    uint16_t count;                 /* fds attached to this message */
+    uint16_t last;                  /* non-zero on the final message */
+    uint8_t kind[HANDOFF_MAX_FDS];  /* enum fd_kind of each fd */
+    uint8_t group[HANDOFF_MAX_FDS]; /* address of a tcp listener or udp socket */
+    uint32_t framelen[HANDOFF_MAX_FDS]; /* buffered input, sent after this */
+};
+
+/* What a new server took over, indexed by fd */
+struct inherited {
+    int count;
+    int order[FD_SETSIZE];          /* fds in the order received */
+    unsigned char kind[FD_SETSIZE];
+    unsigned char group[FD_SETSIZE];
+    unsigned char *frames[FD_SETSIZE];
+    int framelen[FD_SETSIZE];
+};
+
+struct inherited inherited;
+
+/* Create the unix socket a future server connects to for the handoff */
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd, ret;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "handoff path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-        *ptr++ = ' ';
-        *ptr++ = ' ';
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("handoff socket()");
+        return -1;
+    }
 
-        /*
-         *    Loop through the ASCII chars of this line
-         */
-        lrem = remaining;
-        splitcount = 0;
-        for (pos = 0; pos < linelen; pos++) {
-            unsigned char c;
+    /* A previous server that handed off to us still owns the old inode */
+    unlink(path);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == -1) {
+        perror("handoff bind()");
+        close(fd);
+        return -1;
+    }
 
-            /* Split ASCII section if required */
-            if (split == splitcount++) {
-                ptr += sprintf(ptr, "  ");
-                splitcount = 1;
-            }
+    ret = listen(fd, 1);
+    if (ret == -1) {
+        perror("handoff listen()");
+        close(fd);
+        return -1;
+    }
 
-            if (lrem) {
-                c = *((unsigned char *) inptr + pos);
-                if (c > 31 && c < 127)
-                    ptr += sprintf(ptr, "%c", c);
+    printf("Handoff socket: %s\n", path);
+    return fd;
+}
 
-                else
-                    ptr += sprintf(ptr, ".");
-                lrem--;
-            }
-        }
+static int handoff_sendmsg(int ctl, struct handoff_msg *msg, int *fds) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = msg;
+    iov.iov_len = sizeof(*msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (msg->count) {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * msg->count);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * msg->count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * msg->count);
+    }
+
+    if (sendmsg(ctl, &mh, MSG_NOSIGNAL) != sizeof(*msg)) {
+        perror("handoff sendmsg()");
+        return -1;
+    }
+    return 0;
+}
 
-        *ptr++ = '\n';
-        inptr += linelen;
-        remaining -= linelen;
+/* Send the fds in msg, then the buffered input of each */
+static int handoff_sendbatch(int ctl, struct handoff_msg *msg, int *fds, struct worker **owner) {
+    struct conn *c;
+    int i;
+
+    if (handoff_sendmsg(ctl, msg, fds) == -1)
+        return -1;
+
+    for (i = 0; i < msg->count; i++) {
+        if (msg->framelen[i] == 0)
+            continue;
+        c = &owner[i]->conns[fds[i]];
+        if (send(ctl, c->frames, c->framelen, MSG_NOSIGNAL) != c->framelen) {
+            perror("handoff send()");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    *ptr = '\0';
+/* Index of the address tcp/udp socket fd is bound to among the keys seen so far */
+static int handoff_group(int fd, struct addr_key *keys, int *nkeys) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct addr_key k;
+    int i;
 
-    return ptr - hexdump_buffer;
+    if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) == -1) {
+        perror("handoff getsockname()");
+        return 0;
+    }
+    addr_key_set(&k, (struct sockaddr *)&addr, 1);
+    for (i = 0; i < *nkeys; i++)
+        if (addr_key_equal(&keys[i], &k))
+            return i;
+    if (*nkeys == MAX_ADDRS)
+        return MAX_ADDRS - 1;
+    keys[*nkeys] = k;
+    return (*nkeys)++;
 }
 
-static char address[INET6_ADDRSTRLEN];
-char *sockaddr2name(const struct sockaddr *sa) {
-    switch(sa->sa_family) {
-    case AF_INET:
-        inet_ntop(AF_INET, &(((struct sockaddr_in *)sa)->sin_addr), address, INET6_ADDRSTRLEN);
-        break;
+/*
+ *    Send the sockets of every worker to the new server on ctl, listeners
+ *    in worker order so the reuseport groups keep their order.
+ *    Returns 0 once the new server has acked, -1 if we must keep serving.
+ */
+int handoff_send(int ctl) {
+    struct handoff_msg msg;
+    int fds[HANDOFF_MAX_FDS];
+    struct worker *owner[HANDOFF_MAX_FDS];
+    struct addr_key keys[MAX_ADDRS];
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    struct worker *w;
+    char ack;
+    int fd, i, nkeys = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = HANDOFF_MAGIC;
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        for (fd = 0; fd <= w->max_fd; fd++) {
+            if (w->kind[fd] != FD_TCP_LISTEN && w->kind[fd] != FD_UDP && w->kind[fd] != FD_CLIENT &&
+                    w->kind[fd] != FD_UNIX_LISTEN && w->kind[fd] != FD_SHM_LISTEN)
+                continue;
+
+            msg.kind[msg.count] = w->kind[fd];
+            msg.group[msg.count] = (w->kind[fd] == FD_TCP_LISTEN || w->kind[fd] == FD_UDP) ?
+                                   handoff_group(fd, keys, &nkeys) : 0;
+            msg.framelen[msg.count] = (w->kind[fd] == FD_CLIENT) ? w->conns[fd].framelen : 0;
+            owner[msg.count] = w;
+            fds[msg.count++] = fd;
+
+            if (msg.count == HANDOFF_MAX_FDS) {
+                if (handoff_sendbatch(ctl, &msg, fds, owner) == -1)
+                    return -1;
+                msg.count = 0;
+            }
+        }
+    }
 
-    case AF_INET6:
-        inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)sa)->sin6_addr), address, INET6_ADDRSTRLEN);
-        break;
+    msg.last = 1;
+    if (handoff_sendbatch(ctl, &msg, fds, owner) == -1)
+        return -1;
 
-    default:
-        strncpy(address, "Unknown AF", 11);
-        return address;
+    /* The new server acks once it owns everything */
+    setsockopt(ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(ctl, &ack, 1, 0) != 1) {
+        fprintf(stderr, "handoff: no ack from new server, resuming\n");
+        return -1;
     }
+    return 0;
+}
 
-    return address;
+/* Give back everything inherited so far, the old server keeps it all */
+static void handoff_abort(int ctl) {
+    int i, fd;
+
+    for (i = 0; i < inherited.count; i++) {
+        fd = inherited.order[i];
+        free(inherited.frames[fd]);
+        inherited.frames[fd] = NULL;
+        inherited.framelen[fd] = 0;
+        inherited.kind[fd] = FD_NONE;
+        close(fd);
+    }
+    inherited.count = 0;
+    close(ctl);
 }
 
-// address + []:port
-static char nameport[INET6_ADDRSTRLEN + 8];
-char *sockaddr2nameport(const struct sockaddr *sa) {
-    switch(sa->sa_family) {
-    case AF_INET:
-        sprintf(nameport, "%s:%u", sockaddr2name(sa), ntohs(((struct sockaddr_in *)sa)->sin_port));
-        break;
+/*
+ *    Take over the sockets of a server listening on path into inherited.
+ *    Returns the number of fds inherited, 0 if nobody was there or the
+ *    handoff failed part way; without our ack the old server resumes.
+ */
+int handoff_receive(const char *path) {
+    struct sockaddr_un addr;
+    struct handoff_msg msg;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int ctl, fds[HANDOFF_MAX_FDS], nfds, i, fd;
+    unsigned char *frames;
+    ssize_t ret;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    ctl = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (ctl == -1) {
+        perror("handoff socket()");
+        return 0;
+    }
+
+    if (connect(ctl, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        /* ENOENT/ECONNREFUSED: no old server, start from scratch */
+        close(ctl);
+        return 0;
+    }
+
+    printf("Taking over sockets from %s ...\n", path);
+    do {
+        memset(&mh, 0, sizeof(mh));
+        iov.iov_base = &msg;
+        iov.iov_len = sizeof(msg);
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        ret = recvmsg(ctl, &mh, MSG_CMSG_CLOEXEC);
+        if (ret != sizeof(msg) || msg.magic != HANDOFF_MAGIC) {
+            if (ret == -1)
+                perror("handoff recvmsg()");
+            else
+                fprintf(stderr, "handoff: bad message\n");
+            /* Any fds that came with it are ours to close too */
+            for (cmsg = CMSG_FIRSTHDR(&mh); ret > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                    for (i = 0; i < (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int)); i++)
+                        close(((int *)CMSG_DATA(cmsg))[i]);
+            handoff_abort(ctl);
+            return 0;
+        }
+
+        nfds = 0;
+        for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+            }
+        }
+
+        for (i = 0; i < nfds; i++) {
+            fd = fds[i];
+            frames = NULL;
+
+            /* Buffered input follows in order, take it even if we drop the fd */
+            if (i < msg.count && msg.framelen[i] > 0 && msg.framelen[i] <= FRAME_BUFFERLENGTH) {
+                frames = (unsigned char *)malloc(FRAME_BUFFERLENGTH);
+                if (frames == NULL || recv(ctl, frames, FRAME_BUFFERLENGTH, 0) != (ssize_t)msg.framelen[i]) {
+                    perror("handoff recv()");
+                    free(frames);
+                    for (; i < nfds; i++)
+                        close(fds[i]);
+                    handoff_abort(ctl);
+                    return 0;
+                }
+            }
 
-    case AF_INET6:
-        sprintf(nameport, "[%s]:%u", sockaddr2name(sa), ntohs(((struct sockaddr_in6 *)sa)->sin6_port));
-        break;
+            if (i >= msg.count || fd >= FD_SETSIZE || msg.group[i] >= MAX_ADDRS ||
+                    (msg.kind[i] != FD_TCP_LISTEN && msg.kind[i] != FD_UDP && msg.kind[i] != FD_CLIENT &&
+                     msg.kind[i] != FD_UNIX_LISTEN && msg.kind[i] != FD_SHM_LISTEN)) {
+                free(frames);
+                close(fd);
+                continue;
+            }
+            inherited.kind[fd] = msg.kind[i];
+            inherited.group[fd] = msg.group[i];
+            inherited.frames[fd] = frames;
+            inherited.framelen[fd] = frames ? msg.framelen[i] : 0;
+            inherited.order[inherited.count++] = fd;
+        }
+    } while (!msg.last);
 
-    default:
-        strncpy(nameport, "Unknown AF", 11);
+    /* Tell the old server it can go, if it does not hear it it stays */
+    if (send(ctl, "A", 1, MSG_NOSIGNAL) != 1) {
+        perror("handoff ack");
+        handoff_abort(ctl);
+        return 0;
     }
+    close(ctl);
 
-    return nameport;
+    return inherited.count;
 }
 
-int tcpfd = -1, udpfd = -1;
-/* Close socket used for communication with client */
-void close_client_socket(int client_sock_fd, int *max_fd, fd_set *set) {
-    int ret;
-    if (client_sock_fd == tcpfd)
-        return;
-    if (client_sock_fd == udpfd)
-        return;
+/*
+ *    Hand inherited sockets out to the workers. The k-th tcp and udp socket
+ *    of an address goes to worker k, so the group index stays the worker
+ *    id; the rest go round robin. Workers left without a listener on an
+ *    address get new reuseport sockets on it.
+ */
+int adopt_sockets(void) {
+    struct sockaddr_storage addr[MAX_ADDRS];
+    socklen_t addrlen[MAX_ADDRS];
+    int ntcp[MAX_ADDRS] = { 0 }, nudp[MAX_ADDRS] = { 0 };
+    int naddrs = 0, adopted = 0, nunix = 0, nclient = 0, i, g, fd;
+
+    for (i = 0; i < inherited.count; i++) {
+        fd = inherited.order[i];
+        g = inherited.group[fd];
+        switch (inherited.kind[fd]) {
+        case FD_TCP_LISTEN:
+            if (ntcp[g] == 0) {
+                addrlen[g] = sizeof(addr[g]);
+                getsockname(fd, (struct sockaddr *)&addr[g], &addrlen[g]);
+            }
+            if (g >= naddrs)
+                naddrs = g + 1;
+            worker_add_fd(&workers[ntcp[g]++ % nworkers], fd, FD_TCP_LISTEN);
+            break;
+        case FD_UDP:
+            worker_add_fd(&workers[nudp[g]++ % nworkers], fd, FD_UDP);
+            break;
+        case FD_UNIX_LISTEN:
+        case FD_SHM_LISTEN:
+            worker_add_fd(&workers[nunix++ % nworkers], fd, inherited.kind[fd]);
+            break;
+        case FD_CLIENT:
+            printf("Inherited connection #%d\n", fd);
+            worker_add_fd(&workers[nclient++ % nworkers], fd, FD_CLIENT);
+            break;
+        }
+    }
 
-    printf("Closing connection #%d ...\n", client_sock_fd);
-    ret = close(client_sock_fd);
-    if (ret == -1) {
-        perror("close()");
-        client_sock_fd = -1;
+    for (g = 0; g < naddrs; g++) {
+        if (ntcp[g] == 0 || nudp[g] == 0)
+            continue;
+        adopted++;
+        printf("Inherited tcp/udp: %s\n", sockaddr2nameport((struct sockaddr *)&addr[g]));
+        for (i = (ntcp[g] < nudp[g] ? ntcp[g] : nudp[g]); i < nworkers; i++)
+            if (open_listeners(&workers[i], (struct sockaddr *)&addr[g], addrlen[g]) == -1) {
+                /* A single worker server's sockets have no SO_REUSEPORT to join */
+                fprintf(stderr, "Workers %d and up have no listener on %s\n", i,
+                        sockaddr2nameport((struct sockaddr *)&addr[g]));
+                break;
+            }
     }
-    FD_CLR(client_sock_fd, set);
-    *max_fd = (client_sock_fd == *max_fd) ? client_sock_fd - 1 : *max_fd;
+    return adopted ? 0 : -1;
 }
 
-int main(int argc, char *argv[]) {
-    int tcpfd = -1, udpfd = -1, client_sock_fd = -1, sock_fd, max_fd = -1;
-    struct sockaddr_in6 server_addr, client_addr;
-    struct addrinfo *result, *rp;
-    struct addrinfo hints;
-    socklen_t client_addr_len;
-    int ret, flag;
-    fd_set sock_set, work_set;
-    struct timeval timeout;
-    char ch[BUFFERLENGTH];
+void *worker_main(void *arg);
 
-    memset(&server_addr, 0, sizeof(server_addr));
+/* Stop every worker but the first and wait for them to return */
+void quiesce_workers(void) {
+    uint64_t one = 1;
+    int i;
 
-    // IPv6
-    //server_addr.sin6_family = AF_INET6;
-    //server_addr.sin6_addr = in6addr_any;
-    //server_addr.sin6_port = htons(SERVER_PORT);
+    __atomic_store_n(&quiesce, 1, __ATOMIC_SEQ_CST);
+    for (i = 1; i < nworkers; i++) {
+        if (write(workers[i].wakefd, &one, sizeof(one)) != sizeof(one))
+            perror("eventfd write()");
+        pthread_join(workers[i].thread, NULL);
+    }
+    __atomic_store_n(&quiesce, 0, __ATOMIC_SEQ_CST);
+}
 
-    // IPv4
-    //((struct sockaddr *)&server_addr)->sa_family = AF_INET;
-    //((struct sockaddr_in *)&server_addr)->sin_addr.s_addr = INADDR_ANY;
-    //((struct sockaddr_in *)&server_addr)->sin_port = htons(SERVER_PORT);
+/* Start every worker but the first */
+void start_workers(void) {
+    int i, ret;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s name service\n\texample 0.0.0.0 8000\n", argv[0]);
-        exit(EXIT_FAILURE);
+    for (i = 1; i < nworkers; i++) {
+        ret = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create(): %s\n", strerror(ret));
+            exit(EXIT_FAILURE);
+        }
     }
+}
 
-    printf("sizeof sockaddr %lu\n",sizeof(struct sockaddr));
-    printf("sizeof sockaddr_in %lu\n",sizeof(struct sockaddr_in));
-    printf("sizeof sockaddr_in6 %lu\n",sizeof(struct sockaddr_in6));
-    printf("sizeof sockaddr_un %lu\n",sizeof(struct sockaddr_un));
-    printf("sizeof sockaddr_storage %lu\n",sizeof(struct sockaddr_storage));
+/* Handle a handoff request on the first worker's handoff socket */
+void handoff(int handoff_fd) {
+    int ctl, fd, i;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;    /* For wildcard IP address */
-    hints.ai_protocol = 0;          /* Any protocol */
-    hints.ai_canonname = NULL;
-    hints.ai_addr = NULL;
-    hints.ai_next = NULL;
+    ctl = accept(handoff_fd, NULL, NULL);
+    if (ctl == -1) {
+        perror("handoff accept()");
+        return;
+    }
 
-    int s = getaddrinfo(argv[1], argv[2], &hints, &result);
-    if (s != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
+    printf("Handing off sockets ...\n");
+    quiesce_workers();
+    for (i = 0; i < nworkers; i++)
+        offload_drain(&workers[i]);
+    if (handoff_send(ctl) == 0) {
+        /* The new server owns the sockets, drop our references */
+        for (i = 0; i < nworkers; i++)
+            for (fd = 0; fd <= workers[i].max_fd; fd++)
+                if (workers[i].kind[fd] != FD_NONE)
+                    close(fd);
+        close(ctl);
+        printf("Handoff complete, exiting\n");
+        exit(EXIT_SUCCESS);
     }
+    close(ctl);
+    start_workers();
+}
+
+/*
+ *    Lifecycle
+ *
+ *    At startup every address the name resolves to is bound, each by a
+ *    thread of its own, so a name with several addresses and many workers
+ *    is not bound one socket at a time. Within an address the workers
+ *    still join the reuseport group in order, which the steering program
+ *    relies on. Once everything is bound the server reports READY=1 the
+ *    sd_notify way, to $NOTIFY_SOCKET, and on the -R fd. From then on the
+ *    kernel queues connections, even before the workers run.
+ *
+ *    SIGTERM or SIGINT drains the server. Each worker takes in the
+ *    connections already queued on its listeners, then closes the
+ *    listeners and its udp sockets. It goes on serving its clients until
+ *    they hang up or -D seconds pass. Then it sends what is queued, waits
+ *    for its offloaded jobs and closes every fd it has. The server exits
+ *    when the last worker is done. A second signal exits at once.
+ */
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        memcpy(&server_addr, rp->ai_addr, sizeof(server_addr));
+/* One address's sockets for every worker, opened by a thread of its own */
+struct bind_job {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int tcp[MAX_WORKERS], udp[MAX_WORKERS];
+    int bound;                      /* workers with sockets, nworkers when done */
+    int threaded;                   /* thread is to be joined */
+    pthread_t thread;
+};
+
+static void *bind_run(void *arg) {
+    struct bind_job *b = (struct bind_job *)arg;
+
+    /* A reuseport group must be ours alone */
+    b->bound = 0;
+    if (nworkers > 1 && !port_free((struct sockaddr *)&b->addr, b->addrlen))
+        return NULL;
+    for (b->bound = 0; b->bound < nworkers; b->bound++)
+        if (open_sockets(&workers[b->bound], (struct sockaddr *)&b->addr, b->addrlen,
+                         &b->tcp[b->bound], &b->udp[b->bound]) == -1)
+            break;
+    return NULL;
+}
+
+/* Bind the first MAX_ADDRS addresses in result for every worker, returns how many were */
+int bind_all(struct addrinfo *result) {
+    struct bind_job *jobs;
+    struct addrinfo *rp;
+    int n = 0, i, j, bound = 0;
+
+    for (rp = result; rp != NULL && n < MAX_ADDRS; rp = rp->ai_next)
+        n++;
+    jobs = (struct bind_job *)calloc(n, sizeof(*jobs));
+    if (jobs == NULL) {
+        perror("calloc()");
+        return 0;
+    }
 
-        printf("Trying: %s\n", sockaddr2nameport((const struct sockaddr *)&server_addr));
+    for (rp = result, i = 0; i < n; rp = rp->ai_next, i++) {
+        memcpy(&jobs[i].addr, rp->ai_addr, rp->ai_addrlen);
+        jobs[i].addrlen = rp->ai_addrlen;
+        printf("Trying: %s\n", sockaddr2nameport(rp->ai_addr));
+        jobs[i].threaded = (pthread_create(&jobs[i].thread, NULL, bind_run, &jobs[i]) == 0);
+        if (!jobs[i].threaded)
+            bind_run(&jobs[i]);
+    }
 
-        /* Create socket for listening (client requests) */
-        tcpfd = socket(server_addr.sin6_family, SOCK_STREAM, rp->ai_protocol);
-        if (tcpfd == -1) {
-            perror("tcp socket()");
+    for (i = 0; i < n; i++) {
+        if (jobs[i].threaded)
+            pthread_join(jobs[i].thread, NULL);
+        if (jobs[i].bound < nworkers) {
+            if (jobs[i].bound > 0)
+                fprintf(stderr, "Could not bind worker %d on %s\n", jobs[i].bound,
+                        sockaddr2nameport((struct sockaddr *)&jobs[i].addr));
+            for (j = 0; j < jobs[i].bound; j++) {
+                close(jobs[i].tcp[j]);
+                close(jobs[i].udp[j]);
+            }
             continue;
         }
+        for (j = 0; j < nworkers; j++) {
+            worker_add_fd(&workers[j], jobs[i].tcp[j], FD_TCP_LISTEN);
+            worker_add_fd(&workers[j], jobs[i].udp[j], FD_UDP);
+        }
+        printf("Listening on tcp/udp: %s\n", sockaddr2nameport((struct sockaddr *)&jobs[i].addr));
+        bound++;
+    }
+    free(jobs);
+    return bound;
+}
 
-        //if (connect(tcpfd, rp->ai_addr, rp->ai_addrlen) != -1) {
-        //    close(tcpfd);
-        //    break;
-        //}
+/*
+ *    notify - tell whoever started us the state, such as READY=1
+ *
+ *    Sent as a datagram to $NOTIFY_SOCKET, a path or @abstract name as
+ *    sd_notify() would; READY=1 also goes to the -R fd, which is then
+ *    closed.
+ */
+void notify(const char *state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    char msg[64], spec[sizeof(addr.sun_path) + 8];
+    int fd, type, len;
+
+    len = snprintf(msg, sizeof(msg), "%s\nMAINPID=%d\n", state, (int)getpid());
+    snprintf(spec, sizeof(spec), "unix:%s", path ? path : "");
+    if (path != NULL && unix_endpoint(spec, &addr, &addrlen, &type) == 1) {
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd == -1 || sendto(fd, msg, len, MSG_NOSIGNAL, (struct sockaddr *)&addr, addrlen) == -1)
+            perror("notify sendto()");
+        if (fd != -1)
+            close(fd);
+    }
 
-        /* Set socket to reuse address */
-        flag = 1;
-        ret = setsockopt(tcpfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-        if (ret == -1) {
-            perror("setsockopt()");
-            close(tcpfd);
-            continue;
-        }
+    if (ready_fd != -1 && strcmp(state, "READY=1") == 0) {
+        if (write(ready_fd, msg, len) == -1)
+            perror("notify write()");
+        close(ready_fd);
+        ready_fd = -1;
+    }
+}
 
-        /* set non-blocking */
-        int flags = fcntl(tcpfd, F_GETFL, 0);
-        ret = fcntl(tcpfd, F_SETFL, flags | O_NONBLOCK);
-        if (ret == -1) {
-            perror("fnctl()");
-            close(tcpfd);
-            continue;
-        }
+/* SIGTERM and SIGINT: sets stopping and wakes the workers, nothing more */
+static void on_stop(int sig) {
+    uint64_t one = 1;
+    int i, saved = errno;
+    ssize_t ret = 0;
+
+    if (__atomic_exchange_n(&stopping, 1, __ATOMIC_SEQ_CST))
+        _exit(EXIT_FAILURE);
+    for (i = 0; i < nworkers; i++)
+        ret = write(workers[i].wakefd, &one, sizeof(one));
+    (void)ret;
+    errno = saved;
+}
 
-        /* Bind address and socket together */
-        ret = bind(tcpfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        if (ret == -1) {
-            perror("bind()");
-            close(tcpfd);
-            continue;
-        }
+void stop_signals_install(void) {
+    struct sigaction sa;
 
-        /* Create listening queue (client requests) */
-        ret = listen(tcpfd, CLIENT_QUEUE_LEN);
-        if (ret == -1) {
-            perror("listen()");
-            close(tcpfd);
-            continue;
-        }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
 
-        /* Create udp socket for listening (client requests) */
-        udpfd = socket(server_addr.sin6_family, SOCK_DGRAM, 0);
-        if (udpfd == -1) {
-            perror("udp socket()");
-            close(tcpfd);
-            continue;
-        }
+/* Block or unblock them in the calling thread; threads started meanwhile inherit that */
+void stop_signals_block(int how) {
+    sigset_t set;
 
-        /* Bind address and socket together */
-        ret = bind(udpfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
-        if (ret == -1) {
-            perror("udp bind()");
-            close(tcpfd);
-            close(udpfd);
-            continue;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(how, &set, NULL);
+}
+
+/*
+ *    accept_client - take a client from listener fd
+ *
+ *    Returns its fd, or -1 when there is none or accept() failed. Out of
+ *    fds, the connection is accepted on the spare fd and closed at once,
+ *    rather than left ready in the backlog to wake every select.
+ */
+int accept_client(struct worker *w, int fd, uint64_t now) {
+    struct sockaddr_storage addr;
+    struct addr_key key;
+    socklen_t addrlen = sizeof(addr);
+    int client, out_of_fds;
+
+    /* An unbound unix peer fills in the family only */
+    if (w->kind[fd] == FD_UNIX_LISTEN)
+        memset(&addr, 0, sizeof(addr));
+    client = accept(fd, (struct sockaddr *)&addr, &addrlen);
+    if (client == -1) {
+        /* Another worker may have taken it */
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        out_of_fds = (errno == EMFILE || errno == ENFILE);
+        perror("accept()");
+        if (out_of_fds && w->spare_fd != -1) {
+            close(w->spare_fd);
+            client = accept(fd, NULL, NULL);
+            if (client != -1)
+                close(client);
+            w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
         }
-        printf("Listening on tcp/udp: %s\n", sockaddr2nameport((struct sockaddr *)&server_addr));
-        break;
+        return -1;
+    }
+    if (client >= FD_SETSIZE) {
+        fprintf(stderr, "Connection #%d beyond FD_SETSIZE, closed\n", client);
+        close(client);
+        return -1;
     }
 
-    client_addr_len = sizeof(client_addr);
+    /* v4 clients on a v6 socket print as v4 */
+    addr_key_set(&key, (struct sockaddr *)&addr, 1);
+    printf("New connection #%d from: %s ...\n", client,
+           (addr.ss_family == AF_UNIX) ? sockaddr2nameport((struct sockaddr *)&addr) : addr_key_nameport(&key));
+
+    /* Add client socket to set of socket file descriptors */
+    conn_init(w, client, (struct sockaddr *)&addr, addrlen, now);
+    worker_add_fd(w, client, FD_CLIENT);
+    return client;
+}
+
+void worker_close_fd(struct worker *w, int fd) {
+    FD_CLR(fd, &w->sock_set);
+    w->kind[fd] = FD_NONE;
+    close(fd);
+}
 
-    /* Initialize set of file descriptors */
-    FD_ZERO(&sock_set);
+/* Stop taking new work: take in what is queued, then close the listeners */
+void drain_start(struct worker *w, uint64_t now) {
+    int fd;
+
+    w->draining = 1;
+    if (w->drain_at == 0)
+        w->drain_at = now + drain_secs * 1000000000ULL;
+    if (w->id == 0)
+        notify("STOPPING=1");
+    printf("Worker %d draining, %d s at most\n", w->id, drain_secs);
+
+    for (fd = 0; fd <= w->max_fd; fd++) {
+        switch (w->kind[fd]) {
+        case FD_TCP_LISTEN:
+        case FD_UNIX_LISTEN:
+            while (accept_client(w, fd, now) != -1)
+                ;
+            worker_close_fd(w, fd);
+            break;
+        case FD_UDP:
+        case FD_SHM_LISTEN:
+        case FD_HANDOFF:
+            worker_close_fd(w, fd);
+            break;
+        }
+    }
+}
 
-    /* Add tcp listen socket to the set of sockets */
-    FD_SET(tcpfd, &sock_set);
+/* Drained when no client, channel or job is left */
+int drained(struct worker *w) {
+    int fd;
 
-    /* Add udp listen socket to the set of sockets */
-    FD_SET(udpfd, &sock_set);
+    for (fd = 0; fd <= w->max_fd; fd++)
+        if (w->kind[fd] == FD_CLIENT || w->kind[fd] == FD_SHM_CTL)
+            return 0;
+    return w->offloaded == 0;
+}
 
-    /* add stdin ? */
-    //FD_SET(STDIN_FILENO, &sock_set);
+/* Send what is left and close everything but the wakefd */
+void drain_finish(struct worker *w) {
+    int fd, left = 0;
+
+    reply_flush(w, -1);
+    offload_drain(w);
+    for (fd = 0; fd <= w->max_fd; fd++) {
+        switch (w->kind[fd]) {
+        case FD_CLIENT:
+            left++;
+            close_client_socket(w, fd);
+            break;
+        case FD_SHM_CTL:
+            left++;
+            if (w->conns[fd].chan != NULL)
+                shm_close(w, w->conns[fd].chan);
+            else
+                worker_close_fd(w, fd);
+            break;
+        }
+    }
+    printf("Worker %d drained, %d clients cut off\n", w->id, left);
+}
 
-    /* UDP Listen socket is the max socket */
-    max_fd = udpfd;
+/* The select loop of one worker, returns when asked to quiesce or drained */
+void serve(struct worker *w) {
+    int client_sock_fd = -1, sock_fd;
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len;
+    int ret;
+    fd_set work_set;
+    struct timeval timeout;
+    uint64_t now, wait, start;
 
     int lastret = -1;
     while(1) {
-        /* Set up timeout */
+        /* Set up timeout, shorter when a throttled client is due */
         timeout.tv_sec = 1;
         timeout.tv_usec = 0;
+        if (w->throttled) {
+            wait = resume_throttled(w, now_ns());
+            if (wait < 1000000000ULL) {
+                timeout.tv_sec = 0;
+                timeout.tv_usec = wait / 1000 + 1;
+            }
+        }
+        /* Shared memory channels that will not wake us */
+        if (w->shm_more || w->shm_full) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = w->shm_more ? 0 : SHM_RETRY_US;
+        }
+        /* Look at the drain deadline now and then, at once when the last client is gone */
+        if (w->draining && timeout.tv_sec > 0) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = drained(w) ? 0 : DRAIN_TICK_US;
+        }
 
-        /* Copy current set of file descriptors to the working set of
-         * file descriptors */
-        memcpy(&work_set, &sock_set, sizeof(fd_set));
+        /* Spin a while before going to sleep */
+        ret = 0;
+        if (busy_poll)
+            ret = busy_poll_select(w, &work_set);
 
-        /* Wait timeout for something to happen */
-        ret = select(FD_SETSIZE, &work_set, NULL, NULL, &timeout);
+        if (ret == 0) {
+            /* Copy current set of file descriptors to the working set of
+             * file descriptors */
+            memcpy(&work_set, &w->sock_set, sizeof(fd_set));
+
+            /* Wait timeout for something to happen */
+            ret = select(w->max_fd + 1, &work_set, NULL, NULL, &timeout);
+        }
+        now = now_ns();
+        if (timestamping && now >= w->report_at) {
+            hist_report(w);
+            w->report_at = now + timestamping * 1000000000ULL;
+        }
+        /* What select saw may be closed now, it is still there next time */
+        if (__atomic_load_n(&stopping, __ATOMIC_SEQ_CST) && !w->draining) {
+            drain_start(w, now);
+            if (!drained(w))
+                continue;
+        }
+        if (w->draining && (now >= w->drain_at || drained(w))) {
+            drain_finish(w);
+            return;
+        }
+        if (w->shm_more || w->shm_full)
+            shm_retry(w);
+        reply_adapt(w, now);
         if (ret > 0) {
             /* Remember number of events on sockets */
             int count = ret;
@@ -332,101 +2454,500 @@ int main(int argc, char *argv[]) {
             printf("Select %u ...\n", count);
 
             /* Iterate over all sockets */
-            for (sock_fd = 0; sock_fd <= max_fd && count > 0; sock_fd++) {
+            for (sock_fd = 0; sock_fd <= w->max_fd && count > 0; sock_fd++) {
                 /* Test if event was on socket */
                 if (FD_ISSET(sock_fd, &work_set)) {
                     count--;
 
-                    /* Was event on main listen socket (new connection)? */
-                    if (sock_fd == tcpfd) {
-                        /* Do TCP handshake with client */
-                        client_sock_fd = accept(tcpfd,
-                                                (struct sockaddr*)&client_addr,
-                                                &client_addr_len);
+                    /* Closed with a channel earlier in this pass */
+                    if (w->kind[sock_fd] == FD_NONE)
+                        continue;
+
+                    /* Woken up, maybe to stop for a handoff */
+                    if (w->kind[sock_fd] == FD_WAKE) {
+                        uint64_t n;
+                        if (read(w->wakefd, &n, sizeof(n)) == -1)
+                            perror("eventfd read()");
+                        if (w->offloaded)
+                            offload_complete(w);
+                        if (__atomic_load_n(&quiesce, __ATOMIC_SEQ_CST)) {
+                            reply_flush(w, -1);
+                            return;
+                        }
+                    }
+                    /* A new server wants our sockets */
+                    else if (w->kind[sock_fd] == FD_HANDOFF) {
+                        reply_flush(w, -1);
+                        handoff(sock_fd);
+                    }
+                    /* A client setting up a shared memory channel */
+                    else if (w->kind[sock_fd] == FD_SHM_LISTEN) {
+                        client_sock_fd = accept(sock_fd, NULL, NULL);
                         if (client_sock_fd == -1) {
-                            perror("accept()");
-                            close(tcpfd);
-                            return EXIT_FAILURE;
+                            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                perror("shm accept()");
+                            continue;
                         }
-
-                        printf("New connection #%d from: %s ...\n",
-                               client_sock_fd,
-                               sockaddr2nameport((struct sockaddr *)&client_addr));
-
-                        /* Add client socket to set of socket file descriptors */
-                        FD_SET(client_sock_fd, &sock_set);
-                        /* Update the biggest file descriptor */
-                        max_fd = (client_sock_fd > max_fd) ? client_sock_fd : max_fd;
+                        if (client_sock_fd >= FD_SETSIZE) {
+                            close(client_sock_fd);
+                            continue;
+                        }
+                        w->conns[client_sock_fd].chan = NULL;
+                        worker_add_fd(w, client_sock_fd, FD_SHM_CTL);
+                    }
+                    /* Its fds, then only its end */
+                    else if (w->kind[sock_fd] == FD_SHM_CTL) {
+                        if (w->conns[sock_fd].chan != NULL)
+                            shm_close(w, w->conns[sock_fd].chan);
+                        else if (shm_accept(w, sock_fd) == -1) {
+                            if (w->conns[sock_fd].chan != NULL) {
+                                shm_close(w, w->conns[sock_fd].chan);
+                            } else {
+                                FD_CLR(sock_fd, &w->sock_set);
+                                w->kind[sock_fd] = FD_NONE;
+                                close(sock_fd);
+                            }
+                        }
+                    }
+                    /* Requests in a shared memory ring */
+                    else if (w->kind[sock_fd] == FD_SHM) {
+                        uint64_t n;
+                        if (read(sock_fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+                            perror("shm eventfd read()");
+                        if (serve_shm(w, w->conns[sock_fd].chan) == -1)
+                            shm_close(w, w->conns[sock_fd].chan);
+                    }
+                    /* Was event on main listen socket (new connection)? */
+                    else if (w->kind[sock_fd] == FD_TCP_LISTEN || w->kind[sock_fd] == FD_UNIX_LISTEN) {
+                        accept_client(w, sock_fd, now);
                     }
                     /* When event was not on listen socket, then it had to be on
                      * client socket and some data was received. */
                     else {
-                        int nread, nwrite;
+                        int nread, nwrite, avail, ntx = 0;
+
+                        /* Tx timestamps wake us up too */
+                        if (timestamping)
+                            ntx = drain_tx_timestamps(w, sock_fd);
 
                         /* Is there any data to read. */
                         ret = ioctl(sock_fd, FIONREAD, &nread);
                         if (ret == -1) {
                             perror("ioctl()");
-                            close_client_socket(sock_fd, &max_fd, &sock_set);
+                            close_client_socket(w, sock_fd);
                             continue;
                         }
 
                         /* When there is no data to read, then FIN packet was received
-                         * and server should close the connection. */
-                        if (nread == 0)
-                            close_client_socket(sock_fd, &max_fd, &sock_set);
+                         * and server should close the connection. A FIN that came
+                         * with tx timestamps is still there on the next select. */
+                        if (nread == 0) {
+                            if (ntx == 0)
+                                close_client_socket(w, sock_fd);
+                        }
 
                         else {
+                            avail = nread;
+                            if (nread > BUFFERLENGTH)
+                                nread = BUFFERLENGTH;
+
+                            /* Fair share of this iteration, nothing if throttled */
+                            if (w->kind[sock_fd] == FD_CLIENT) {
+                                nread = conn_allowance(w, sock_fd, nread, now);
+                                if (nread == 0)
+                                    continue;
+                            }
+
+                            /* A seqpacket record is read whole, the rest of it would be lost */
+                            if (w->kind[sock_fd] == FD_CLIENT && w->conns[sock_fd].seqpacket)
+                                nread = BUFFERLENGTH;
+
+                            if (w->kind[sock_fd] == FD_CLIENT)
+                                w->conns[sock_fd].backlog = (nread < avail);
+
+                            if (framed && w->kind[sock_fd] == FD_CLIENT && !w->conns[sock_fd].seqpacket) {
+                                if (serve_frames(w, sock_fd, nread) == -1)
+                                    close_client_socket(w, sock_fd);
+                                continue;
+                            }
+
                             /* Wait for data from client */
-                            ret = recvfrom(sock_fd, ch, nread,
-                                           MSG_DONTWAIT,
-                                           (struct sockaddr *)&client_addr,
-                                           &client_addr_len);
+                            client_addr_len = sizeof(client_addr);
+                            ret = recv_packet(w, sock_fd, w->in, nread,
+                                              MSG_DONTWAIT,
+                                              (struct sockaddr *)&client_addr,
+                                              &client_addr_len, &start);
                             if (ret == -1) {
-                                perror("recvfrom()");
-                                close_client_socket(sock_fd, &max_fd, &sock_set);
+                                /* udp datagram taken by another worker */
+                                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                    continue;
+                                perror("recvmsg()");
+                                close_client_socket(w, sock_fd);
                                 continue;
                             }
+                            nread = ret;
+
+                            if (capture && w->kind[sock_fd] == FD_UDP)
+                                capture_packet(CAPTURE_UDP, 0, (struct sockaddr *)&client_addr, w->in, nread);
+                            else if (capture)
+                                capture_packet(CAPTURE_TCP, sock_fd, (struct sockaddr *)&w->conns[sock_fd].peer, w->in, nread);
 
                             printf("Received %i bytes from #%d (%s)\n",
                                    nread,
                                    sock_fd,
                                    sockaddr2nameport((struct sockaddr *)&client_addr));
 
-                            nwrite = hexdump(ch, nread, 16, 8);
-                            //printf("sent\n%s",hexdump_buffer);
+                            if (w->kind[sock_fd] == FD_UDP &&
+                                    !datagram_allowed(w, (struct sockaddr *)&client_addr, nread, now)) {
+                                printf("Rate limited, dropping %i bytes\n", nread);
+                                continue;
+                            }
+
+                            /* Big ones go to the pool, the loop carries on */
+                            if (pool_threads && nread >= offload_min &&
+                                    offload(w, sock_fd, (struct sockaddr *)&client_addr, client_addr_len, nread) == 0)
+                                continue;
+
+                            if (reply_room(w, sock_fd, HEXDUMP_LENGTH(nread, 16, 8), 1) == -1) {
+                                close_client_socket(w, sock_fd);
+                                continue;
+                            }
+                            nwrite = hexdump(w->out + w->outlen, w->in, nread, 16, 8);
+                            //printf("sent\n%s",w->out);
                             /* Send response to client */
                             printf("Sending %i bytes to #%d (%s)\n",
                                    nwrite,
                                    sock_fd,
                                    sockaddr2nameport((struct sockaddr *)&client_addr));
-                            ret = sendto(sock_fd, hexdump_buffer, nwrite,
-                                         0,
-                                         (struct sockaddr *)&client_addr,
-                                         client_addr_len);
+                            w->replies++;
+                            if (reply_queues(w, sock_fd)) {
+                                reply_add(w, sock_fd, w->out + w->outlen, nwrite, start);
+                                w->outlen += nwrite;
+                                ret = w->coalescing ? 0 : reply_flush(w, sock_fd);
+                            } else {
+                                tx_start(w, sock_fd, start);
+                                ret = send_reply(w, sock_fd, w->out + w->outlen, nwrite,
+                                                 (struct sockaddr *)&client_addr,
+                                                 client_addr_len, now);
+                            }
                             if (ret == -1) {
-                                perror("sendto()");
-                                close_client_socket(sock_fd, &max_fd, &sock_set);
+                                close_client_socket(w, sock_fd);
                                 continue;
                             }
                         }
                     }
                 }
             }
+
+            /* Everything this iteration queued goes out together */
+            reply_flush(w, -1);
         } else if(ret == 0) {
+            if (w->throttled || w->shm_more || w->shm_full)
+                continue;
             if (lastret == 0) {
                 printf(".");
                 fflush(stdout);
             } else
-                printf("Timeout, %d fds ", max_fd);
+                printf("Timeout, %d fds ", w->max_fd);
             lastret=ret;
-        } else {
+        } else if (errno != EINTR) {
             perror("select()");
-            close(tcpfd);
-            return EXIT_FAILURE;
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void *worker_main(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    int fd;
+
+    /* Buffers survive a failed handoff, the thread does not */
+    if (w->in == NULL) {
+        worker_pin(w);
+        w->in = (char *)worker_alloc(w, BUFFERLENGTH);
+        w->out = (char *)worker_alloc(w, COALESCE_BYTES);
+        w->conns = (struct conn *)worker_alloc(w, FD_SETSIZE * sizeof(struct conn));
+        addr_map_init(&w->peers, worker_alloc(w, ADDR_MAP_SIZE(PEER_SLOTS, sizeof(struct peer))),
+                      PEER_SLOTS, sizeof(struct peer));
+        bucket_init(&w->overflow.bucket, now_ns());
+        w->iov = (struct iovec *)worker_alloc(w, COALESCE_IOV * sizeof(struct iovec));
+        w->headers = (unsigned char *)worker_alloc(w, COALESCE_IOV / 2 * FRAME_HEADER_MAX);
+        w->pending = (struct pending *)worker_alloc(w, COALESCE_IOV * sizeof(struct pending));
+        w->window_at = now_ns();
+
+        /* Sockets added before there was anywhere to keep their state */
+        for (fd = 0; fd <= w->max_fd; fd++)
+            if (w->kind[fd] == FD_UDP)
+                udp_init(w, fd);
+
+        /* Clients inherited in a hot restart */
+        for (fd = 0; fd <= w->max_fd; fd++) {
+            if (w->kind[fd] != FD_CLIENT)
+                continue;
+            peerlen = sizeof(peer);
+            if (getpeername(fd, (struct sockaddr *)&peer, &peerlen) == -1)
+                peerlen = 0;
+            conn_init(w, fd, (struct sockaddr *)&peer, peerlen, now_ns());
+            w->conns[fd].frames = inherited.frames[fd];
+            w->conns[fd].framelen = inherited.framelen[fd];
+        }
+    }
+
+    serve(w);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in6 server_addr;
+    struct addrinfo *result;
+    struct addrinfo hints;
+    int s, i, opt, ncpus = 0;
+    int cpus[MAX_WORKERS];
+    const char *handoff_path = NULL, *capture_path = NULL;
+    const char *unix_specs[MAX_UNIX];
+    int nunix = 0;
+    int capture_mb = CAPTURE_MB;
+    struct worker *w;
+
+    uint64_t started = now_ns();
+
+    memset(&server_addr, 0, sizeof(server_addr));
+
+    // IPv6
+    //server_addr.sin6_family = AF_INET6;
+    //server_addr.sin6_addr = in6addr_any;
+    //server_addr.sin6_port = htons(SERVER_PORT);
+
+    // IPv4
+    //((struct sockaddr *)&server_addr)->sa_family = AF_INET;
+    //((struct sockaddr_in *)&server_addr)->sin_addr.s_addr = INADDR_ANY;
+    //((struct sockaddr_in *)&server_addr)->sin_port = htons(SERVER_PORT);
+
+    nworkers = 0;
+    while ((opt = getopt(argc, argv, "H:w:c:S:r:b:q:P:FT:C:Z:U:j:o:u:m:K:D:R:")) != -1) {
+        switch (opt) {
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 1 || nworkers > MAX_WORKERS)
+                goto usage;
+            break;
+        case 'c':
+            ncpus = parse_cpulist(optarg, cpus, MAX_WORKERS);
+            if (ncpus < 1)
+                goto usage;
+            break;
+        case 'S':
+            if (strcmp(optarg, "cbpf") == 0)
+                steering = STEER_CBPF;
+            else if (strcmp(optarg, "cpu") == 0)
+                steering = STEER_CPU;
+            else if (strcmp(optarg, "none") == 0)
+                steering = STEER_NONE;
+            else
+                goto usage;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'b':
+            burst = atof(optarg);
+            break;
+        case 'P':
+            busy_poll = atoi(optarg);
+            if (busy_poll < 0)
+                goto usage;
+            break;
+        case 'F':
+            framed = 1;
+            break;
+        case 'T':
+            timestamping = atoi(optarg);
+            if (timestamping < 1)
+                goto usage;
+            break;
+        case 'j':
+            pool_threads = atoi(optarg);
+            if (pool_threads < 0 || pool_threads > WP_MAX_THREADS)
+                goto usage;
+            break;
+        case 'o':
+            offload_min = atoi(optarg);
+            if (offload_min < 1)
+                goto usage;
+            break;
+        case 'u':
+            if (nunix == MAX_UNIX)
+                goto usage;
+            unix_specs[nunix++] = optarg;
+            break;
+        case 'm':
+            shm_spec = optarg;
+            break;
+        case 'K':
+            coalesce_rate = atoi(optarg);
+            if (coalesce_rate < -1)
+                goto usage;
+            break;
+        case 'D':
+            drain_secs = atoi(optarg);
+            if (drain_secs < 0)
+                goto usage;
+            break;
+        case 'R':
+            ready_fd = atoi(optarg);
+            if (ready_fd < 0 || fcntl(ready_fd, F_GETFD) == -1)
+                goto usage;
+            break;
+        case 'U':
+            sockbuf_max = atoi(optarg);
+            if (sockbuf_max < 0)
+                goto usage;
+            break;
+        case 'C':
+            capture_path = optarg;
+            break;
+        case 'Z':
+            capture_mb = atoi(optarg);
+            if (capture_mb < 1)
+                goto usage;
+            break;
+        case 'q':
+            quantum = atoi(optarg);
+            if (quantum < HEXDUMP_LINE)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 2) {
+usage:
+        fprintf(stderr, "Usage: %s [-H handoff.sock] [-w workers] [-c cpulist] [-S cbpf|cpu|none]\n"
+                "\t[-r bytes/s] [-b burst] [-q quantum] [-P busy_poll_us] [-F] [-T secs] [-K requests/s]\n"
+                "\t[-C capture.ring [-Z megabytes]] [-U udp_buffer_max]\n"
+                "\t[-j pool_threads [-o offload_bytes]] [-u unix:/path|unix:@name|unixpacket:...]...\n"
+                "\t[-m unix:/path|unix:@name] [-D drain_secs] [-R ready_fd] name service\n"
+                "\texample 0.0.0.0 8000\n"
+                "\texample -c 0-3 :: 8000\n"
+                "\texample -r 1000000 :: 8000\n"
+                "\texample -u unix:/run/server.sock -u unixpacket:@server :: 8000\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* A bucket holds a second's worth and at least a full read by default */
+    if (rate > 0 && burst <= 0)
+        burst = (rate > BUFFERLENGTH) ? rate : BUFFERLENGTH;
+
+    /* One worker per listed cpu unless told otherwise */
+    if (nworkers == 0)
+        nworkers = ncpus ? ncpus : 1;
+
+    /* Until the workers and the pool are started, only the main thread takes them */
+    stop_signals_block(SIG_BLOCK);
+    stop_signals_install();
+
+    if (capture_path && capture_open(capture_path, (uint64_t)capture_mb << 20) == -1)
+        exit(EXIT_FAILURE);
+
+    /* Initialize the workers */
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        w->id = i;
+        w->cpu = ncpus ? cpus[i % ncpus] : -1;
+        w->node = -1;
+        w->max_fd = -1;
+        FD_ZERO(&w->sock_set);
+
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->wakefd == -1) {
+            perror("eventfd()");
+            exit(EXIT_FAILURE);
+        }
+        worker_add_fd(w, w->wakefd, FD_WAKE);
+        w->done.efd = w->wakefd;
+        w->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    if (pool_threads && wp_start(&pool, pool_threads) == -1)
+        exit(EXIT_FAILURE);
+
+    /* Hot restart: inherit the sockets of a running server and skip binding */
+    if (handoff_path && handoff_receive(handoff_path)) {
+        if (adopt_sockets() == -1) {
+            fprintf(stderr, "Could not adopt inherited sockets\n");
+            exit(EXIT_FAILURE);
         }
+        goto serve;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;    /* For wildcard IP address */
+    hints.ai_protocol = 0;          /* Any protocol */
+    hints.ai_canonname = NULL;
+    hints.ai_addr = NULL;
+    hints.ai_next = NULL;
+
+    s = getaddrinfo(argv[optind], argv[optind + 1], &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        exit(EXIT_FAILURE);
+    }
+
+    s = bind_all(result);
+    freeaddrinfo(result);
+    if (s == 0) {
+        fprintf(stderr, "Could not bind\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Unix listeners spread over the workers, the first with the first */
+    for (i = 0; i < nunix; i++)
+        if (open_unix_listener(&workers[i % nworkers], unix_specs[i], FD_UNIX_LISTEN) == -1)
+            exit(EXIT_FAILURE);
+    if (shm_spec && open_unix_listener(&workers[nunix % nworkers], shm_spec, FD_SHM_LISTEN) == -1)
+        exit(EXIT_FAILURE);
+
+serve:
+    /* One program per reuseport group, the first worker has a socket in each */
+    if (nworkers > 1 && steering == STEER_CBPF) {
+        for (s = 0; s <= workers[0].max_fd; s++)
+            if (workers[0].kind[s] == FD_TCP_LISTEN || workers[0].kind[s] == FD_UDP)
+                attach_steering(s);
+    }
+
+    /* Listen for the next server taking over from us */
+    if (handoff_path) {
+        s = handoff_listen(handoff_path);
+        if (s != -1)
+            worker_add_fd(&workers[0], s, FD_HANDOFF);
     }
 
+    notify("READY=1");
+    printf("Ready in %.3f ms\n", (now_ns() - started) / 1e6);
+    start_workers();
+    stop_signals_block(SIG_UNBLOCK);
+    worker_main(&workers[0]);
+
+    /* Drained, the first worker was the last to start */
+    for (i = 1; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+    stop_signals_block(SIG_BLOCK);
+    for (i = 0; i < nworkers; i++) {
+        close(workers[i].wakefd);
+        if (workers[i].spare_fd != -1)
+            close(workers[i].spare_fd);
+    }
+    if (capture)
+        munmap(capture, CAPTURE_DATA + capture->size);
+    printf("Drained, exiting\n");
     return EXIT_SUCCESS;
 }
 
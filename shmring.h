@@ -0,0 +1,288 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ *    Shared memory rings
+ *
+ *    A channel is a memfd holding a shm_channel header and two single
+ *    producer, single consumer rings: requests from the client, replies
+ *    from the server. Messages are written and read in place, no syscall
+ *    and no copy through the kernel. Each ring has an eventfd its consumer
+ *    polls; the producer writes it only when it finds the ring empty after
+ *    publishing, so a busy consumer is not woken once per message.
+ *
+ *    Head and tail count bytes ever written and read, on cache lines of
+ *    their own. A record is a shm_record and its payload, 8 byte aligned,
+ *    and never wraps around the end of the ring; the space it would not fit
+ *    in is skipped with a SHM_WRAP record. The producer stores head, then
+ *    loads tail; the consumer stores tail, then loads head, both
+ *    sequentially consistent. Either the producer sees the ring was empty
+ *    and wakes the consumer, or the consumer sees the new head before it
+ *    goes back to sleep.
+ *
+ *    The client creates the memfd sealed against shrinking, so the server
+ *    can map it without risking SIGBUS, and both sides check what they
+ *    read from the other before trusting it. The producer counts head in
+ *    its private shm_ring and only ever stores it to the shared one; the
+ *    tail it loads must be aligned and at most one ring behind.
+ */
+
+#define SHM_MAGIC          0x474e4952   /* "RING" */
+#define SHM_VERSION        1
+#define SHM_ALIGN          8
+#define SHM_WRAP           UINT32_MAX   /* record length: skip to the start */
+#define SHM_HEADER_SIZE    512          /* channel header, ring controls included */
+
+enum shm_mode {
+    SHM_HEXDUMP,
+    SHM_ECHO,
+    SHM_ROT13,
+    SHM_MODES,
+};
+
+/* Shared control of one ring */
+struct shm_ring_ctl {
+    uint64_t head __attribute__((aligned(64)));     /* producer */
+    uint64_t tail __attribute__((aligned(64)));     /* consumer */
+};
+
+/* At offset 0 of the memfd, the request ring follows, then the reply ring */
+struct shm_channel {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mode;                  /* enum shm_mode, what the server does */
+    uint32_t reserved;
+    uint64_t req_size;              /* bytes, power of two */
+    uint64_t rep_size;
+    struct shm_ring_ctl req __attribute__((aligned(64)));
+    struct shm_ring_ctl rep;
+};
+
+/* What the server checked of a client's channel; the client can still write the header */
+struct shm_layout {
+    uint64_t length;                /* of the mapping */
+    uint64_t req_size;
+    uint64_t rep_size;
+    int mode;
+};
+
+struct shm_record {
+    uint32_t length;                /* payload bytes, or SHM_WRAP */
+    uint32_t reserved;
+};
+
+/* One side's view of a ring */
+struct shm_ring {
+    struct shm_ring_ctl *ctl;
+    unsigned char *data;
+    uint64_t size;
+    int efd;                        /* eventfd of the consumer */
+    uint64_t head;                  /* producer: bytes published, never read back from ctl */
+    uint64_t record;                /* producer: where the reserved record goes */
+    uint32_t limit;                 /* producer: bytes reserved for it */
+};
+
+#define SHM_RECORD_LENGTH(len) \
+    ((sizeof(struct shm_record) + (len) + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1))
+
+static inline uint64_t shm_channel_length(uint64_t req_size, uint64_t rep_size) {
+    return SHM_HEADER_SIZE + req_size + rep_size;
+}
+
+static inline void shm_ring_attach(struct shm_ring *r, struct shm_ring_ctl *ctl, void *data, uint64_t size, int efd) {
+    r->ctl = ctl;
+    r->data = (unsigned char *)data;
+    r->size = size;
+    r->efd = efd;
+    r->head = 0;
+    r->record = 0;
+    r->limit = 0;
+}
+
+/* The two rings of channel ch laid out as l */
+static inline void shm_channel_rings(struct shm_channel *ch, const struct shm_layout *l,
+                                     struct shm_ring *req, int req_efd, struct shm_ring *rep, int rep_efd) {
+    shm_ring_attach(req, &ch->req, (char *)ch + SHM_HEADER_SIZE, l->req_size, req_efd);
+    shm_ring_attach(rep, &ch->rep, (char *)ch + SHM_HEADER_SIZE + l->req_size, l->rep_size, rep_efd);
+}
+
+/*
+ *    shm_channel_create - a new channel for mode in a sealed memfd
+ *
+ *    Ring sizes are powers of two. Returns the mapping and leaves the memfd
+ *    in *fd, or NULL.
+ */
+static inline struct shm_channel *shm_channel_create(uint64_t req_size, uint64_t rep_size, int mode, int *fd) {
+    uint64_t len = shm_channel_length(req_size, rep_size);
+    struct shm_channel *ch;
+
+    *fd = memfd_create("shmring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd == -1) {
+        perror("memfd_create()");
+        return NULL;
+    }
+    if (ftruncate(*fd, len) == -1 || fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        perror("memfd ftruncate()/F_ADD_SEALS");
+        close(*fd);
+        return NULL;
+    }
+    ch = (struct shm_channel *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (ch == MAP_FAILED) {
+        perror("mmap()");
+        close(*fd);
+        return NULL;
+    }
+    ch->magic = SHM_MAGIC;
+    ch->version = SHM_VERSION;
+    ch->mode = mode;
+    ch->req_size = req_size;
+    ch->rep_size = rep_size;
+    return ch;
+}
+
+/* Layout of a channel we created */
+static inline void shm_channel_layout(const struct shm_channel *ch, struct shm_layout *l) {
+    l->req_size = ch->req_size;
+    l->rep_size = ch->rep_size;
+    l->length = shm_channel_length(l->req_size, l->rep_size);
+    l->mode = ch->mode;
+}
+
+/* Map the channel in memfd fd from a client, NULL if it is not one we can trust */
+static inline struct shm_channel *shm_channel_map(int fd, struct shm_layout *l) {
+    struct shm_channel *ch;
+    struct stat st;
+    int seals;
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) == -1 || st.st_size < SHM_HEADER_SIZE) {
+        fprintf(stderr, "shm: not a sealed memfd\n");
+        return NULL;
+    }
+    l->length = st.st_size;
+    ch = (struct shm_channel *)mmap(NULL, l->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ch == MAP_FAILED) {
+        perror("mmap()");
+        return NULL;
+    }
+
+    /* Read once, the header stays the client's to scribble on */
+    l->req_size = __atomic_load_n(&ch->req_size, __ATOMIC_RELAXED);
+    l->rep_size = __atomic_load_n(&ch->rep_size, __ATOMIC_RELAXED);
+    l->mode = __atomic_load_n(&ch->mode, __ATOMIC_RELAXED);
+    if (ch->magic != SHM_MAGIC || ch->version != SHM_VERSION || l->mode < 0 || l->mode >= SHM_MODES ||
+            l->req_size < 4096 || l->rep_size < 4096 ||
+            (l->req_size & (l->req_size - 1)) || (l->rep_size & (l->rep_size - 1)) ||
+            shm_channel_length(l->req_size, l->rep_size) != l->length) {
+        fprintf(stderr, "shm: bad channel header\n");
+        munmap(ch, l->length);
+        return NULL;
+    }
+    return ch;
+}
+
+/*
+ *    shm_ring_reserve - room for a record of up to len payload bytes
+ *
+ *    Returns where to write the payload, NULL while the ring is too full.
+ *    The record is not visible until shm_ring_publish(). Returns (void *)-1
+ *    when the consumer wrote a tail that cannot be.
+ */
+static inline void *shm_ring_reserve(struct shm_ring *r, uint32_t len) {
+    uint64_t need = SHM_RECORD_LENGTH(len), head = r->head, tail, end;
+    struct shm_record *rec;
+
+    if (need > r->size / 2)
+        return NULL;
+    tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > r->size || tail % SHM_ALIGN)
+        return (void *)-1;
+    end = r->size - head % r->size;
+
+    /* Skip to the start when the record does not fit before the end */
+    if (end < need) {
+        if (head + end + need - tail > r->size)
+            return NULL;
+        rec = (struct shm_record *)(r->data + head % r->size);
+        rec->length = SHM_WRAP;
+        head += end;
+    } else if (head + need - tail > r->size) {
+        return NULL;
+    }
+    r->record = head;
+    r->limit = len;
+    return r->data + head % r->size + sizeof(struct shm_record);
+}
+
+/* Publish the reserved record with len bytes, waking the consumer if the ring was empty */
+static inline void shm_ring_publish(struct shm_ring *r, uint32_t len) {
+    struct shm_record *rec = (struct shm_record *)(r->data + r->record % r->size);
+    uint64_t old = r->head, one = 1;
+
+    if (len > r->limit)
+        len = r->limit;
+    rec->length = len;
+    r->head = r->record + SHM_RECORD_LENGTH(len);
+    __atomic_store_n(&r->ctl->head, r->head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->ctl->tail, __ATOMIC_SEQ_CST) == old && write(r->efd, &one, sizeof(one)) == -1 &&
+            errno != EAGAIN)
+        perror("shm eventfd write()");
+}
+
+/* Copy len bytes in as one record, returns -1 while the ring is too full or broken */
+static inline int shm_ring_send(struct shm_ring *r, const void *data, uint32_t len) {
+    void *p = shm_ring_reserve(r, len);
+
+    if (p == NULL || p == (void *)-1)
+        return -1;
+    memcpy(p, data, len);
+    shm_ring_publish(r, len);
+    return 0;
+}
+
+/*
+ *    shm_ring_peek - the oldest record, NULL when the ring is empty
+ *
+ *    Its payload length goes in *len. Returns (void *)-1 when the producer
+ *    wrote something that cannot be a record.
+ */
+static inline void *shm_ring_peek(struct shm_ring *r, uint32_t *len) {
+    uint64_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&r->ctl->head, __ATOMIC_SEQ_CST);
+    struct shm_record *rec;
+
+    while (1) {
+        if (head == tail)
+            return NULL;
+        if (head - tail > r->size || tail % SHM_ALIGN)
+            return (void *)-1;
+        rec = (struct shm_record *)(r->data + tail % r->size);
+        *len = rec->length;
+        if (*len != SHM_WRAP)
+            break;
+        tail += r->size - tail % r->size;
+        __atomic_store_n(&r->ctl->tail, tail, __ATOMIC_SEQ_CST);
+    }
+    if (SHM_RECORD_LENGTH(*len) > head - tail || SHM_RECORD_LENGTH(*len) > r->size - tail % r->size)
+        return (void *)-1;
+    return rec + 1;
+}
+
+/* Done with the record shm_ring_peek() returned, its space goes back to the producer */
+static inline void shm_ring_release(struct shm_ring *r, uint32_t len) {
+    uint64_t tail = __atomic_load_n(&r->ctl->tail, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&r->ctl->tail, tail + SHM_RECORD_LENGTH(len), __ATOMIC_SEQ_CST);
+}
+
+#endif /* SHMRING_H */
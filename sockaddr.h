@@ -0,0 +1,115 @@
+#ifndef SOCKADDR_H
+#define SOCKADDR_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Longest name: unix: and a full sun_path */
+#define SOCKADDR_NAMELEN (sizeof("unix:") + sizeof(((struct sockaddr_un *)0)->sun_path))
+
+/*
+ *    sockaddr2name/sockaddr2nameport - printable address of a sockaddr
+ *
+ *    The result lives in a per-thread static buffer and is overwritten by
+ *    the next call.
+ */
+
+static __thread char address[SOCKADDR_NAMELEN];
+static inline char *sockaddr2name(const struct sockaddr *sa) {
+    const struct sockaddr_un *sun = (const struct sockaddr_un *)sa;
+
+    switch(sa->sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &(((struct sockaddr_in *)sa)->sin_addr), address, INET6_ADDRSTRLEN);
+        break;
+
+    case AF_INET6:
+        inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)sa)->sin6_addr), address, INET6_ADDRSTRLEN);
+        break;
+
+    /* Abstract names print with @, unbound peers as plain unix */
+    case AF_UNIX:
+        if (sun->sun_path[0] != '\0')
+            snprintf(address, sizeof(address), "unix:%.*s", (int)sizeof(sun->sun_path), sun->sun_path);
+        else if (sun->sun_path[1] != '\0')
+            snprintf(address, sizeof(address), "unix:@%.*s", (int)sizeof(sun->sun_path) - 1, sun->sun_path + 1);
+        else
+            strcpy(address, "unix");
+        break;
+
+    default:
+        strncpy(address, "Unknown AF", 11);
+        return address;
+    }
+
+    return address;
+}
+
+// address + []:port
+static __thread char nameport[SOCKADDR_NAMELEN + 8];
+static inline char *sockaddr2nameport(const struct sockaddr *sa) {
+    switch(sa->sa_family) {
+    case AF_INET:
+        sprintf(nameport, "%s:%u", sockaddr2name(sa), ntohs(((struct sockaddr_in *)sa)->sin_port));
+        break;
+
+    case AF_INET6:
+        sprintf(nameport, "[%s]:%u", sockaddr2name(sa), ntohs(((struct sockaddr_in6 *)sa)->sin6_port));
+        break;
+
+    case AF_UNIX:
+        strcpy(nameport, sockaddr2name(sa));
+        break;
+
+    default:
+        strncpy(nameport, "Unknown AF", 11);
+    }
+
+    return nameport;
+}
+
+/*
+ *    unix_endpoint - parse a unix domain endpoint
+ *
+ *    unix:/path and unix:@name are SOCK_STREAM, unixpacket:/path and
+ *    unixpacket:@name SOCK_SEQPACKET; @name lives in the abstract namespace
+ *    and leaves nothing in the filesystem. Returns 1 and fills *sun, *len
+ *    and *socktype for an endpoint, 0 if spec is not one, -1 if its name
+ *    does not fit.
+ */
+static inline int unix_endpoint(const char *spec, struct sockaddr_un *sun, socklen_t *len, int *socktype) {
+    const char *name;
+    size_t n;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        name = spec + 5;
+        *socktype = SOCK_STREAM;
+    } else if (strncmp(spec, "unixpacket:", 11) == 0) {
+        name = spec + 11;
+        *socktype = SOCK_SEQPACKET;
+    } else {
+        return 0;
+    }
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    n = strlen(name);
+    if (n == 0 || (name[0] == '@' && n == 1) || n >= sizeof(sun->sun_path))
+        return -1;
+    memcpy(sun->sun_path, name, n);
+    if (name[0] == '@') {
+        /* Abstract names are not terminated, the length says where they end */
+        sun->sun_path[0] = '\0';
+        *len = offsetof(struct sockaddr_un, sun_path) + n;
+    } else {
+        *len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+    }
+    return 1;
+}
+
+#endif /* SOCKADDR_H */
@@ -0,0 +1,270 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ *    Work stealing pool
+ *
+ *    Event loops hand jobs too big to run inline to a pool of threads and
+ *    get them back, done, through an eventfd they already poll.
+ *
+ *    Submitted jobs go on a lock-free stack. A pool thread that runs out of
+ *    work takes the whole stack, runs the oldest job and pushes the rest
+ *    onto its own deque. Each thread pops its own deque at the bottom and
+ *    other threads steal from the top with a compare and swap (Chase-Lev),
+ *    so a burst taken by one thread spreads over the idle ones without
+ *    locks. Threads with nothing to do sleep on a condition variable.
+ *
+ *    A finished job is pushed onto the wp_done stack of its loop, and the
+ *    loop's eventfd is written when that stack goes from empty to not, so
+ *    a loop wakes up once per batch of completions.
+ */
+
+#define WP_DEQUE_SIZE      1024         /* power of two */
+#define WP_MAX_THREADS     64
+
+struct wp_done;
+
+struct wp_job {
+    void (*run)(struct wp_job *);
+    struct wp_job *next;            /* in the submit and done stacks */
+    struct wp_done *done;           /* where it goes when it has run */
+};
+
+/* Finished jobs of one loop */
+struct wp_done {
+    struct wp_job *head;
+    int efd;                        /* eventfd to wake the loop */
+};
+
+/* Chase-Lev deque: the owner pushes and pops at bottom, thieves take top */
+struct wp_deque {
+    int64_t top;
+    int64_t bottom;
+    struct wp_job *slots[WP_DEQUE_SIZE];
+};
+
+struct wp_pool;
+
+struct wp_thread {
+    struct wp_deque deque;
+    struct wp_pool *pool;
+    unsigned int seed;              /* picks whom to steal from */
+    pthread_t thread;
+};
+
+struct wp_pool {
+    struct wp_job *submitted;       /* lock-free stack, newest first */
+    int nthreads;
+    struct wp_thread *threads;
+    pthread_mutex_t lock;           /* for sleeping only */
+    pthread_cond_t wake;
+    int sleepers;
+};
+
+static inline void wp_stack_push(struct wp_job **head, struct wp_job *job, struct wp_job **old) {
+    *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+    do
+        job->next = *old;
+    while (!__atomic_compare_exchange_n(head, old, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Take the whole stack, oldest first. Safe with any number of takers. */
+static inline struct wp_job *wp_stack_take(struct wp_job **head) {
+    struct wp_job *job = __atomic_exchange_n(head, (struct wp_job *)NULL, __ATOMIC_ACQUIRE), *prev = NULL, *next;
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        job->next = prev;
+        prev = job;
+    }
+    return prev;
+}
+
+static inline int wp_deque_push(struct wp_deque *d, struct wp_job *job) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= WP_DEQUE_SIZE)
+        return -1;
+    __atomic_store_n(&d->slots[b & (WP_DEQUE_SIZE - 1)], job, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline struct wp_job *wp_deque_pop(struct wp_deque *d) {
+    int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1, t;
+    struct wp_job *job = NULL;
+
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    if (t <= b) {
+        job = __atomic_load_n(&d->slots[b & (WP_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+        if (t == b) {
+            /* The last one, race the thieves for it */
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                job = NULL;
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return job;
+}
+
+static inline struct wp_job *wp_deque_steal(struct wp_deque *d) {
+    int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE), b;
+    struct wp_job *job;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    job = __atomic_load_n(&d->slots[t & (WP_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return job;
+}
+
+static inline int wp_deque_empty(struct wp_deque *d) {
+    return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* Hand a finished job back to its loop */
+static inline void wp_complete(struct wp_job *job) {
+    struct wp_done *done = job->done;
+    struct wp_job *old;
+    uint64_t one = 1;
+
+    wp_stack_push(&done->head, job, &old);
+    if (old == NULL && write(done->efd, &one, sizeof(one)) == -1)
+        perror("eventfd write()");
+}
+
+/* Finished jobs of done, oldest first, for the loop once its eventfd fired */
+static inline struct wp_job *wp_done_take(struct wp_done *done) {
+    return wp_stack_take(&done->head);
+}
+
+static inline void wp_wake_one(struct wp_pool *pool) {
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static inline void wp_submit(struct wp_pool *pool, struct wp_job *job, struct wp_done *done) {
+    struct wp_job *old;
+
+    job->done = done;
+    wp_stack_push(&pool->submitted, job, &old);
+    wp_wake_one(pool);
+}
+
+/* Anything to do for a thread about to sleep */
+static inline int wp_pending(struct wp_pool *pool) {
+    int i;
+
+    if (__atomic_load_n(&pool->submitted, __ATOMIC_SEQ_CST) != NULL)
+        return 1;
+    for (i = 0; i < pool->nthreads; i++)
+        if (!wp_deque_empty(&pool->threads[i].deque))
+            return 1;
+    return 0;
+}
+
+static inline struct wp_job *wp_find_job(struct wp_thread *self) {
+    struct wp_pool *pool = self->pool;
+    struct wp_job *job, *rest, *next;
+    int i, start;
+
+    job = wp_deque_pop(&self->deque);
+    if (job != NULL)
+        return job;
+
+    /* New work: run the oldest, keep the rest where others can steal it */
+    job = wp_stack_take(&pool->submitted);
+    if (job != NULL) {
+        for (rest = job->next; rest != NULL; rest = next) {
+            next = rest->next;
+            if (wp_deque_push(&self->deque, rest) == -1) {
+                rest->run(rest);
+                wp_complete(rest);
+            }
+        }
+        if (job->next != NULL)
+            wp_wake_one(pool);
+        return job;
+    }
+
+    start = rand_r(&self->seed) % pool->nthreads;
+    for (i = 0; i < pool->nthreads; i++) {
+        struct wp_thread *victim = &pool->threads[(start + i) % pool->nthreads];
+
+        if (victim != self && (job = wp_deque_steal(&victim->deque)) != NULL)
+            return job;
+    }
+    return NULL;
+}
+
+static inline void *wp_thread_main(void *arg) {
+    struct wp_thread *self = (struct wp_thread *)arg;
+    struct wp_pool *pool = self->pool;
+    struct wp_job *job;
+
+    while (1) {
+        job = wp_find_job(self);
+        if (job != NULL) {
+            job->run(job);
+            wp_complete(job);
+            continue;
+        }
+
+        /* Count ourselves asleep before the last look, see wp_wake_one() */
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (!wp_pending(pool))
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/* Start nthreads pool threads, returns -1 if none could be started */
+static inline int wp_start(struct wp_pool *pool, int nthreads) {
+    int i;
+
+    pool->submitted = NULL;
+    pool->sleepers = 0;
+    pool->nthreads = nthreads;
+    pool->threads = (struct wp_thread *)calloc(nthreads, sizeof(struct wp_thread));
+    if (pool->threads == NULL) {
+        perror("calloc()");
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        pool->threads[i].pool = pool;
+        pool->threads[i].seed = i + 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i].thread, NULL, wp_thread_main, &pool->threads[i]) != 0) {
+            perror("pthread_create()");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif /* WORKPOOL_H */